@@ -0,0 +1,108 @@
+#pragma once
+
+#include "std.hpp"
+#include "timing.hpp"
+
+
+// lossless chunk codec: each 16 bit channel is delta coded against
+// the same pixel in the previous frame (the previous pixel for the
+// first frame), then the low and high bytes of the deltas are split
+// in planes that are entropy coded on their own with rANS
+static inline constexpr size_t codec_channels = 4;
+
+// where the channels are in a chunk: value i (frame major) of
+// channel c is at pixels[offset[c] + i * stride[c]]
+struct codec_layout
+{
+	size_t channels;
+	size_t offset[codec_channels];
+	size_t stride[codec_channels];
+};
+
+codec_layout interleaved_layout(size_t channels);
+size_t chunk_encode_bound(const codec_layout &, size_t frame_pixels, size_t frame_count);
+size_t encode_chunk(const std::uint16_t *pixels, const codec_layout &,
+	size_t frame_pixels, size_t frame_count, std::uint8_t *out);
+bool decode_chunk(const std::uint8_t *in, size_t size, std::uint16_t *pixels,
+	const codec_layout &, size_t frame_pixels, size_t frame_count);
+
+// encodes one chunk at a time off the main thread, the channels in
+// parallel to planes of their own that are then put together in `out`
+struct chunk_encoder
+{
+	struct job
+	{
+		const std::uint16_t *pixels;
+		codec_layout layout;
+		size_t frame_pixels;
+		size_t frame_count;
+		std::uint8_t *out;
+	};
+
+	chunk_encoder();
+	~chunk_encoder();
+
+	void start(job);
+	// the size of the encoded chunk, once it is done
+	size_t finish();
+
+private:
+	void work();
+
+	std::thread workers[codec_channels];
+	std::mutex lock;
+	std::condition_variable wake;
+	std::condition_variable done;
+	job current;
+	// room for every channel at its largest
+	std::unique_ptr<std::uint8_t[]> scratch;
+	size_t scratch_size;
+	size_t sizes[codec_channels];
+	// the next channel to hand out, and the channels not
+	// encoded yet and the gathering of them that follows
+	unsigned next;
+	unsigned pending;
+	bool quit;
+};
+
+// decodes one chunk at a time off the main thread, the channels are
+// independent so they go in parallel, each to its own plane of host
+// memory, and one thread then stores them all to `pixels`
+struct chunk_decoder
+{
+	struct job
+	{
+		const std::uint8_t *in;
+		size_t size;
+		std::uint16_t *pixels;
+		codec_layout layout;
+		size_t frame_pixels;
+		size_t frame_count;
+	};
+
+	chunk_decoder();
+	~chunk_decoder();
+
+	void start(job);
+	// false if the chunk is not done by the deadline
+	bool try_finish(instant_t deadline);
+	void finish();
+
+private:
+	void work();
+
+	std::thread workers[codec_channels];
+	std::mutex lock;
+	std::condition_variable wake;
+	std::condition_variable done;
+	job current;
+	// a plane for every channel
+	std::unique_ptr<std::uint16_t[]> scratch;
+	size_t scratch_size;
+	// the next channel to hand out, and the channels not
+	// decoded yet and the store of them that follows
+	unsigned next;
+	unsigned pending;
+	bool quit;
+};
+
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "std.hpp"
+
+
+// scene_state of src/shared_data.glsl as laid out in the scene_spec buffer
+struct cpu_scene
+{
+	float q_orientation[4];
+
+	float cam_pos[3];
+	float sch_radius;
+
+	float sphere_pos[3];
+	float focal_length;
+
+	std::uint32_t iterations;
+	float dt;
+	float inv_screen_width;
+	float accr_light;
+
+	float accr_normal[3];
+	float accr_height;
+
+	float accr_x[3];
+	float accr_min_r;
+
+	float accr_z[3];
+	float accr_max_r;
+
+	float accr_abso;
+	float accr_light2;
+	float red_exponent;
+	float green_exponent;
+
+	float blue_exponent;
+	std::uint32_t accr_hide;
+	std::uint32_t integrator;
+	float tolerance;
+
+	float escape_r;
+	std::uint32_t use_lut;
+	float dphi;
+	float reproject_tolerance;
+};
+static_assert(sizeof(cpu_scene) == 10 * sizeof(float[4]));
+
+// the tracer needs AVX2 and FMA
+bool cpu_trace_supported();
+
+// traces the frames of a chunk the way compute.glsl does, 8 rays at
+// a time, into what pack_ray() returns for every pixel: four floats,
+// frame major, laid out like the chunk's texture array. Every scene
+// is integrated with RK4 and without the deflection table.
+// The chunk is cut in tiles and every worker starts on an even share
+// of them, then steals half of what another has left once it is done,
+// so the threads that got the photon ring don't finish on their own
+struct cpu_tracer
+{
+	explicit cpu_tracer(unsigned threads);
+	~cpu_tracer();
+
+	void trace_chunk(const cpu_scene *scenes, size_t frame_count,
+		size_t width, size_t height, bool oct48, float *pixels);
+
+private:
+	struct job
+	{
+		const cpu_scene *scenes;
+		size_t width;
+		size_t height;
+		bool oct48;
+		float *pixels;
+	};
+
+	// the tiles [begin, end) left to a worker, it takes them
+	// from the front and the others steal from the back
+	struct alignas(64) tile_range
+	{
+		std::mutex lock;
+		size_t begin;
+		size_t end;
+	};
+
+	void work(unsigned self);
+	bool take_tile(unsigned self, size_t &tile);
+	void trace_tile(size_t tile);
+
+	unsigned n_threads;
+	std::unique_ptr<std::thread[]> workers;
+	std::unique_ptr<tile_range[]> ranges;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::condition_variable done;
+	job current;
+	// bumped for every chunk, and the workers still on it
+	unsigned generation;
+	unsigned pending;
+	bool quit;
+};
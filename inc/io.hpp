@@ -9,21 +9,47 @@ enum class io_work_type {
 	write,
 };
 
+enum class io_result {
+	pending,
+	done,
+	failed,
+};
+
+// identifies one submitted request until its completion is claimed
+using io_token = std::uint64_t;
+static inline constexpr io_token io_no_token = 0;
+
 struct io_request
 {
 	void *buf;
 	size_t size;
 	off_t addr;
+	io_token token;
 };
 
-void io_init();
+void io_init(unsigned queue_depth);
 void io_fini();
-bool issue_io_request(io_work_type type, void *buf, size_t size, off_t addr);
-void blocking_open_read(const char *path);
+// io_no_token if the queue is full or the submission failed
+io_token issue_io_request(io_work_type type, void *buf, size_t size, off_t addr);
+// direct_io bypasses the page cache when the filesystem allows it
+void blocking_open_read(const char *path, bool direct_io = false);
 void blocking_open_trunc(const char *path);
 void blocking_open_recover(const char *path);
 void blocking_close();
-bool try_complete_io_request(instant_t deadline);
-bool try_complete_io_request(time_interval timeout);
-void complete_io_request();
+// requests that fall within the registered buffer skip mapping it each time
+bool io_register_buffer(void *buf, size_t size);
+void io_unregister_buffer();
+// with direct I/O a read at addr is widened to whole blocks: buf must sit
+// io_read_lead(addr) bytes past an io_read_alignment() aligned address
+// with the rest of the last block to spare after the requested size
+size_t io_read_alignment();
+size_t io_read_lead(off_t addr);
+// wait for `token` in particular, the completions of other requests
+// that arrive meanwhile are kept until they are claimed in turn
+io_result try_complete_io_request(io_token token, instant_t deadline);
+io_result try_complete_io_request(io_token token, time_interval timeout);
+io_result complete_io_request(io_token token);
+// claims whichever request completes first, io_no_token on timeout
+io_token try_complete_any_io_request(time_interval timeout, io_result *result);
+void complete_all_io_requests();
 
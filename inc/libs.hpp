@@ -5,6 +5,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <liburing.h>
 // missing stb image for now
 
@@ -5,10 +5,20 @@
 
 enum cmd_type { OUTPUT, INPUT, RECOVER };
 
+static inline constexpr unsigned max_playback_depth = 64;
+
 struct command_line {
 	const char *sim_path;
 	const char *script_path;
 	cmd_type mode;
+	bool direct_io;
+	bool cpu_trace;
+	bool offscreen;
+	float preview_hz;
+	// chunks -i keeps around
+	unsigned playback_depth;
+	// -i plays forward in a loop instead of back and forth
+	bool loop;
 };
 
 command_line parse_command_line(int argc, char **argv);
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "std.hpp"
+
+
+// bounded queue between one producer and one consumer thread, without
+// locks: each side only ever writes its own index and reads the other's
+template<typename T, size_t N>
+struct spsc_queue
+{
+	static_assert(std::has_single_bit(N));
+
+	T items[N];
+	// the next item to pop, written by the consumer
+	alignas(64) std::atomic<size_t> head{0};
+	// the next item to push, written by the producer
+	alignas(64) std::atomic<size_t> tail{0};
+
+	// false if the queue is full
+	bool try_push(const T &item)
+	{
+		const size_t t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) == N) {
+			return false;
+		}
+		items[t % N] = item;
+		tail.store(t + 1, std::memory_order_release);
+		tail.notify_one();
+		return true;
+	}
+
+	// false if the queue is empty
+	bool try_pop(T &item)
+	{
+		const size_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire)) {
+			return false;
+		}
+		item = items[h % N];
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	// sleeps until there is an item
+	T pop()
+	{
+		T item;
+		while (!try_pop(item)) {
+			tail.wait(head.load(std::memory_order_relaxed), std::memory_order_acquire);
+		}
+		return item;
+	}
+};
@@ -7,8 +7,15 @@
 #include <chrono>
 #include <span>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <cstdint>
 #include <cstring>
 #include <cstddef>
 #include <cassert>
 #include <numbers>
+#include <cmath>
+#include <memory>
+#include <algorithm>
+#include <bit>
@@ -6,19 +6,32 @@
 
 struct glfw_context
 {
-	glfw_context();
+	// offscreen windows don't need glfw, nor a display
+	explicit glfw_context(bool init);
 	~glfw_context();
+
+	bool initialized;
 };
 
 struct window
 {
 	GLFWwindow *handle;
+	// the EGLDisplay and EGLContext of offscreen windows
+	void *egl_display;
+	void *egl_context;
 
 	window(int width, int height, glfw_context &);
+	// a surfaceless EGL context: there is no default
+	// framebuffer to draw to and nothing is presented
+	explicit window(glfw_context &);
 	~window();
 
+	bool offscreen() const;
+
 	operator bool() const;
 	void resize(int width, int height);
 	void present();
+	// what present() does for input, without drawing
+	void poll_events();
 };
 
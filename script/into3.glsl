@@ -24,6 +24,8 @@ void init()
 
 	beg.iterations = 2048;
 	end.iterations = 32768;
+	scene.integrator = INTEGRATOR_RK45;
+	scene.tolerance = 1e-5;
 
 	win.screen_width = 1600;
 	win.screen_height = 900;
@@ -27,6 +27,7 @@ void init()
 
 	beg.iterations = iterations;
 	end.iterations = iterations;
+	scene.escape_r = 45.0;
 
 	win.screen_width = 1280;
 	win.screen_height = 720;
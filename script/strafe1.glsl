@@ -32,6 +32,7 @@ void init()
 
 	beg.iterations = iterations;
 	end.iterations = iterations;
+	scene.escape_r = 60.0;
 
 	win.screen_width = 1280;
 	win.screen_height = 720;
@@ -0,0 +1,496 @@
+#include "codec.hpp"
+
+
+// byte-wise rANS with 32 bit state (see Duda, and ryg_rans)
+static constexpr std::uint32_t prob_bits = 12;
+static constexpr std::uint32_t prob_scale = 1u << prob_bits;
+static constexpr std::uint32_t rans_low = 1u << 23;
+static constexpr size_t n_symbols = 256;
+
+enum plane_mode : std::uint8_t {
+	plane_raw,
+	plane_rans,
+};
+
+// a plane is its mode byte followed by either the raw bytes or
+// the frequency table, the payload size and the rANS payload
+static constexpr size_t rans_plane_header = 1 + n_symbols * sizeof(std::uint16_t) + sizeof(std::uint32_t);
+
+static void put_u32(std::uint8_t *out, std::uint32_t x)
+{
+	std::memcpy(out, &x, sizeof x);
+}
+
+static std::uint32_t get_u32(const std::uint8_t *in)
+{
+	std::uint32_t x;
+	std::memcpy(&x, in, sizeof x);
+	return x;
+}
+
+// scales the histogram to sum to prob_scale keeping every present symbol
+static void normalize(const size_t *count, size_t total, std::uint16_t *freq)
+{
+	std::uint32_t sum = 0;
+	for (size_t s = 0; s < n_symbols; ++s) {
+		freq[s] = 0;
+		if (count[s]) {
+			freq[s] = std::max<std::uint32_t>(1, std::uint64_t(count[s]) * prob_scale / total);
+			sum += freq[s];
+		}
+	}
+	// rounding is fixed up on the most frequent symbols
+	while (sum != prob_scale) {
+		size_t top = 0;
+		for (size_t s = 1; s < n_symbols; ++s) {
+			if (freq[s] > freq[top]) {
+				top = s;
+			}
+		}
+		if (sum < prob_scale) {
+			const auto add = prob_scale - sum;
+			freq[top] += add;
+			sum += add;
+		} else {
+			assert(freq[top] > 1);
+			--freq[top];
+			--sum;
+		}
+	}
+}
+
+// scratch must hold 2*size + 8 bytes, returns the bytes written to out
+static size_t encode_plane(const std::uint8_t *plane, size_t size, std::uint8_t *out, std::uint8_t *scratch)
+{
+	size_t count[n_symbols] = {};
+	for (size_t i = 0; i < size; ++i) {
+		++count[plane[i]];
+	}
+	std::uint16_t freq[n_symbols];
+	std::uint16_t start[n_symbols];
+	double bits = 0.0;
+	if (size) {
+		normalize(count, size, freq);
+		std::uint32_t cumul = 0;
+		for (size_t s = 0; s < n_symbols; ++s) {
+			start[s] = cumul;
+			cumul += freq[s];
+			if (count[s]) {
+				bits += count[s] * (prob_bits - std::log2(double(freq[s])));
+			}
+		}
+	}
+
+	// noise does not compress, don't bother
+	if (!size || bits / 8.0 + rans_plane_header >= double(size)) {
+		out[0] = plane_raw;
+		std::memcpy(out + 1, plane, size);
+		return 1 + size;
+	}
+
+	// rANS encodes backwards so the decoder reads forwards,
+	// even and odd bytes use separate states so that decoding
+	// them does not form one long dependency chain
+	std::uint8_t *const end = scratch + 2 * size + 8;
+	std::uint8_t *at = end;
+	std::uint32_t x[2] = { rans_low, rans_low };
+	for (size_t i = size; i-- > 0;) {
+		const std::uint8_t s = plane[i];
+		std::uint32_t &xi = x[i & 1];
+		const std::uint32_t x_max = ((rans_low >> prob_bits) << 8) * freq[s];
+		while (xi >= x_max) {
+			*--at = xi & 0xff;
+			xi >>= 8;
+		}
+		xi = ((xi / freq[s]) << prob_bits) + (xi % freq[s]) + start[s];
+	}
+	at -= 4;
+	put_u32(at, x[1]);
+	at -= 4;
+	put_u32(at, x[0]);
+	const size_t payload = end - at;
+	if (payload + rans_plane_header >= 1 + size) {
+		out[0] = plane_raw;
+		std::memcpy(out + 1, plane, size);
+		return 1 + size;
+	}
+
+	out[0] = plane_rans;
+	std::memcpy(out + 1, freq, sizeof freq);
+	put_u32(out + 1 + sizeof freq, payload);
+	std::memcpy(out + rans_plane_header, at, payload);
+	return rans_plane_header + payload;
+}
+
+// returns the bytes consumed from in, 0 if they are not a valid plane
+static size_t decode_plane(const std::uint8_t *in, size_t avail, std::uint8_t *plane, size_t size)
+{
+	if (avail < 1) {
+		return 0;
+	}
+	if (in[0] == plane_raw) {
+		if (avail < 1 + size) {
+			return 0;
+		}
+		std::memcpy(plane, in + 1, size);
+		return 1 + size;
+	}
+	if (in[0] != plane_rans || avail < rans_plane_header) {
+		return 0;
+	}
+	std::uint16_t freq[n_symbols];
+	std::uint16_t start[n_symbols];
+	std::memcpy(freq, in + 1, sizeof freq);
+	const size_t payload = get_u32(in + 1 + sizeof freq);
+	if (payload < 8 || avail - rans_plane_header < payload) {
+		return 0;
+	}
+	std::uint8_t symbol[prob_scale];
+	std::uint32_t cumul = 0;
+	for (size_t s = 0; s < n_symbols; ++s) {
+		if (cumul + freq[s] > prob_scale) {
+			return 0;
+		}
+		start[s] = cumul;
+		std::memset(symbol + cumul, s, freq[s]);
+		cumul += freq[s];
+	}
+	if (cumul != prob_scale) {
+		return 0;
+	}
+
+	const std::uint8_t *at = in + rans_plane_header;
+	const std::uint8_t *const end = at + payload;
+	std::uint32_t x0 = get_u32(at);
+	std::uint32_t x1 = get_u32(at + 4);
+	at += 8;
+	auto step = [&](std::uint32_t &x, std::uint8_t &out) {
+		const std::uint32_t slot = x & (prob_scale - 1);
+		const std::uint8_t s = symbol[slot];
+		out = s;
+		x = freq[s] * (x >> prob_bits) + slot - start[s];
+		while (x < rans_low && at < end) {
+			x = (x << 8) | *at++;
+		}
+	};
+	size_t i = 0;
+	for (; i + 1 < size; i += 2) {
+		step(x0, plane[i]);
+		step(x1, plane[i + 1]);
+	}
+	if (i < size) {
+		step(x0, plane[i]);
+	}
+	return rans_plane_header + payload;
+}
+
+// the chunk starts with the encoded size of every channel
+// so that they can be located and decoded independently
+static constexpr size_t chunk_header = codec_channels * sizeof(std::uint32_t);
+
+codec_layout interleaved_layout(size_t channels)
+{
+	assert(channels <= codec_channels);
+	codec_layout layout;
+	layout.channels = channels;
+	for (size_t c = 0; c < channels; ++c) {
+		layout.offset[c] = c;
+		layout.stride[c] = channels;
+	}
+	return layout;
+}
+
+// the bytes a channel encodes to at most, both of its planes
+static size_t channel_encode_bound(size_t plane)
+{
+	return 2 * (1 + plane);
+}
+
+size_t chunk_encode_bound(const codec_layout &layout, size_t frame_pixels, size_t frame_count)
+{
+	return chunk_header + layout.channels * channel_encode_bound(frame_pixels * frame_count);
+}
+
+// channel c of `pixels` to `out`, returns the bytes written
+static size_t encode_channel(const std::uint16_t *pixels, const codec_layout &layout, size_t c,
+	size_t frame_pixels, size_t frame_count, std::uint8_t *out)
+{
+	const size_t size = frame_pixels * frame_count;
+	auto lo = std::make_unique<std::uint8_t[]>(size);
+	auto hi = std::make_unique<std::uint8_t[]>(size);
+	auto scratch = std::make_unique<std::uint8_t[]>(2 * size + 8);
+	const std::uint16_t *channel = pixels + layout.offset[c];
+	const size_t stride = layout.stride[c];
+	std::uint16_t prev = 0;
+	for (size_t i = 0; i < size; ++i) {
+		if (i >= frame_pixels) {
+			prev = channel[(i - frame_pixels) * stride];
+		}
+		const std::uint16_t delta = channel[i * stride] - prev;
+		lo[i] = delta & 0xff;
+		hi[i] = delta >> 8;
+		if (i < frame_pixels) {
+			prev = channel[i * stride];
+		}
+	}
+	size_t written = encode_plane(lo.get(), size, out, scratch.get());
+	written += encode_plane(hi.get(), size, out + written, scratch.get());
+	return written;
+}
+
+size_t encode_chunk(const std::uint16_t *pixels, const codec_layout &layout,
+	size_t frame_pixels, size_t frame_count, std::uint8_t *out)
+{
+	std::uint8_t *at = out + chunk_header;
+	std::memset(out, 0, chunk_header);
+	for (size_t c = 0; c < layout.channels; ++c) {
+		const size_t size = encode_channel(pixels, layout, c, frame_pixels, frame_count, at);
+		put_u32(out + c * sizeof(std::uint32_t), size);
+		at += size;
+	}
+	return at - out;
+}
+
+// into its own plane, the frame delta is undone against
+// what was decoded there so that `pixels` is never read
+static bool decode_channel(const std::uint8_t *in, size_t size, size_t c,
+	std::uint16_t *plane_out, size_t frame_pixels, size_t frame_count)
+{
+	if (size < chunk_header) {
+		return false;
+	}
+	size_t offset = chunk_header;
+	for (size_t i = 0; i < c; ++i) {
+		offset += get_u32(in + i * sizeof(std::uint32_t));
+	}
+	const size_t channel_size = get_u32(in + c * sizeof(std::uint32_t));
+	if (offset > size || size - offset < channel_size) {
+		return false;
+	}
+	in += offset;
+
+	const size_t plane = frame_pixels * frame_count;
+	auto lo = std::make_unique<std::uint8_t[]>(plane);
+	auto hi = std::make_unique<std::uint8_t[]>(plane);
+	const size_t lo_size = decode_plane(in, channel_size, lo.get(), plane);
+	if (!lo_size) {
+		return false;
+	}
+	if (!decode_plane(in + lo_size, channel_size - lo_size, hi.get(), plane)) {
+		return false;
+	}
+
+	std::uint16_t prev = 0;
+	for (size_t i = 0; i < plane; ++i) {
+		if (i >= frame_pixels) {
+			prev = plane_out[i - frame_pixels];
+		}
+		const std::uint16_t value = prev + (lo[i] | (hi[i] << 8));
+		plane_out[i] = value;
+		if (i < frame_pixels) {
+			prev = value;
+		}
+	}
+	return true;
+}
+
+// stores the decoded planes where the layout puts them, in address order
+// where channels are interleaved: `pixels` may be write combined memory
+static void interleave(const std::uint16_t *planes, std::uint16_t *pixels,
+	const codec_layout &layout, size_t plane)
+{
+	for (size_t c = 0; c < layout.channels;) {
+		// the channels that take turns within the same stretch
+		const size_t stride = layout.stride[c];
+		size_t n = 1;
+		while (c + n < layout.channels && n < stride
+			&& layout.stride[c + n] == stride && layout.offset[c + n] == layout.offset[c] + n) {
+			++n;
+		}
+		std::uint16_t *out = pixels + layout.offset[c];
+		const std::uint16_t *in = planes + c * plane;
+		for (size_t i = 0; i < plane; ++i) {
+			for (size_t k = 0; k < n; ++k) {
+				out[i * stride + k] = in[k * plane + i];
+			}
+		}
+		c += n;
+	}
+}
+
+bool decode_chunk(const std::uint8_t *in, size_t size, std::uint16_t *pixels,
+	const codec_layout &layout, size_t frame_pixels, size_t frame_count)
+{
+	const size_t plane = frame_pixels * frame_count;
+	auto planes = std::make_unique<std::uint16_t[]>(layout.channels * plane);
+	bool ok = true;
+	for (size_t c = 0; c < layout.channels; ++c) {
+		ok &= decode_channel(in, size, c, planes.get() + c * plane, frame_pixels, frame_count);
+	}
+	interleave(planes.get(), pixels, layout, plane);
+	return ok;
+}
+
+chunk_decoder::chunk_decoder()
+	: current{}, scratch_size{0}, next{0}, pending{0}, quit{false}
+{
+	for (size_t c = 0; c < codec_channels; ++c) {
+		workers[c] = std::thread{&chunk_decoder::work, this};
+	}
+}
+
+chunk_decoder::~chunk_decoder()
+{
+	{
+		std::lock_guard guard{lock};
+		quit = true;
+	}
+	wake.notify_all();
+	for (auto &worker: workers) {
+		worker.join();
+	}
+}
+
+void chunk_decoder::start(job j)
+{
+	{
+		std::lock_guard guard{lock};
+		assert(pending == 0);
+		current = j;
+		const size_t size = j.layout.channels * j.frame_pixels * j.frame_count;
+		if (scratch_size < size) {
+			scratch = std::make_unique<std::uint16_t[]>(size);
+			scratch_size = size;
+		}
+		next = 0;
+		// the channels, then storing them
+		pending = j.layout.channels + 1;
+	}
+	wake.notify_all();
+}
+
+bool chunk_decoder::try_finish(instant_t deadline)
+{
+	std::unique_lock guard{lock};
+	if (deadline == instant_t::max()) {
+		done.wait(guard, [this] { return pending == 0; });
+		return true;
+	}
+	return done.wait_until(guard, deadline, [this] { return pending == 0; });
+}
+
+void chunk_decoder::finish()
+{
+	try_finish(instant_t::max());
+}
+
+void chunk_decoder::work()
+{
+	std::unique_lock guard{lock};
+	for (;;) {
+		wake.wait(guard, [this] { return quit || next < current.layout.channels; });
+		if (quit) {
+			return;
+		}
+		const size_t c = next++;
+		const job j = current;
+		const size_t plane = j.frame_pixels * j.frame_count;
+		guard.unlock();
+		const bool ok = decode_channel(j.in, j.size, c, scratch.get() + c * plane,
+			j.frame_pixels, j.frame_count);
+		if (!ok) {
+			std::fprintf(stderr, "[codec] corrupt chunk (channel %zu)\n", c);
+		}
+		guard.lock();
+		// the last channel decoded stores them all, from this thread only
+		if (--pending == 1) {
+			guard.unlock();
+			interleave(scratch.get(), j.pixels, j.layout, plane);
+			guard.lock();
+			--pending;
+			done.notify_all();
+		}
+	}
+}
+
+chunk_encoder::chunk_encoder()
+	: current{}, scratch_size{0}, sizes{}, next{0}, pending{0}, quit{false}
+{
+	for (size_t c = 0; c < codec_channels; ++c) {
+		workers[c] = std::thread{&chunk_encoder::work, this};
+	}
+}
+
+chunk_encoder::~chunk_encoder()
+{
+	{
+		std::lock_guard guard{lock};
+		quit = true;
+	}
+	wake.notify_all();
+	for (auto &worker: workers) {
+		worker.join();
+	}
+}
+
+void chunk_encoder::start(job j)
+{
+	{
+		std::lock_guard guard{lock};
+		assert(pending == 0);
+		current = j;
+		const size_t size = j.layout.channels * channel_encode_bound(j.frame_pixels * j.frame_count);
+		if (scratch_size < size) {
+			scratch = std::make_unique<std::uint8_t[]>(size);
+			scratch_size = size;
+		}
+		next = 0;
+		// the channels, then gathering them
+		pending = j.layout.channels + 1;
+	}
+	wake.notify_all();
+}
+
+size_t chunk_encoder::finish()
+{
+	std::unique_lock guard{lock};
+	done.wait(guard, [this] { return pending == 0; });
+	size_t size = chunk_header;
+	for (size_t c = 0; c < current.layout.channels; ++c) {
+		size += sizes[c];
+	}
+	return size;
+}
+
+void chunk_encoder::work()
+{
+	std::unique_lock guard{lock};
+	for (;;) {
+		wake.wait(guard, [this] { return quit || next < current.layout.channels; });
+		if (quit) {
+			return;
+		}
+		const size_t c = next++;
+		const job j = current;
+		const size_t bound = channel_encode_bound(j.frame_pixels * j.frame_count);
+		guard.unlock();
+		const size_t size = encode_channel(j.pixels, j.layout, c,
+			j.frame_pixels, j.frame_count, scratch.get() + c * bound);
+		guard.lock();
+		sizes[c] = size;
+		// the last channel encoded puts them all after the header
+		if (--pending == 1) {
+			guard.unlock();
+			std::memset(j.out, 0, chunk_header);
+			std::uint8_t *at = j.out + chunk_header;
+			for (size_t k = 0; k < j.layout.channels; ++k) {
+				put_u32(j.out + k * sizeof(std::uint32_t), sizes[k]);
+				std::memcpy(at, scratch.get() + k * bound, sizes[k]);
+				at += sizes[k];
+			}
+			guard.lock();
+			--pending;
+			done.notify_all();
+		}
+	}
+}
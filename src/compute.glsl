@@ -1,12 +1,39 @@
 // include src/shared_data.glsl
 
 layout(local_size_x = 8, local_size_y = 8, local_size_z = 1) in;
-uniform layout(binding=0,rgba16_snorm) writeonly restrict image2D screen;
+uniform layout(binding=0,rgba16_snorm) restrict image2DArray screen;
+// one scene per frame of the render, after the script's own
 layout(std430,binding=1) readonly restrict buffer scene_spec
 {
-	scene_state scene;
+	scene_state scene_init;
+	scene_state scenes[];
 };
 uniform layout(location=3) ivec2 px_base;
+uniform layout(location=4) bool lut_pass;
+uniform layout(location=5) uint lut_scene;
+uniform layout(binding=1,rg32f) writeonly restrict image2DArray lut_image;
+uniform layout(binding=3) sampler2DArray deflection_lut;
+uniform layout(location=6) bool oct48;
+uniform layout(binding=2,r32ui) restrict uimage2DArray screen_ray;
+uniform layout(binding=3,r16) restrict image2DArray screen_light;
+// the dispatch covers the frames from frame_offset on, and with
+// reproject the first frame of the chunk is already traced
+uniform layout(location=7) uint frame_offset;
+uniform layout(location=8) bool reproject;
+// with grid_step only every that many pixels are traced, with
+// refine_step those in between are then filled in from them
+uniform layout(location=9) uint grid_step;
+uniform layout(location=10) uint refine_step;
+uniform layout(location=11) float refine_tolerance;
+// rays per pixel, more up to max_samples while they vary by more
+// than sample_tolerance
+uniform layout(location=12) uint samples;
+uniform layout(location=13) uint max_samples;
+uniform layout(location=14) float sample_tolerance;
+// the frame of the render in the first layer
+uniform layout(location=15) uint chunk_start;
+
+scene_state scene;
 
 void ray_accel(float r, float b, float dr_dt, out float dphi_dt, out float d2r_dt2)
 {
@@ -44,6 +71,44 @@ vec3 rk4(vec3 y, float b, float h)
 	return y + h * inv6 * (k1 + 2.0*k2 + 2.0*k3 + k4);
 }
 
+// Dormand-Prince 5(4): k1 is dy/dt at y on entry and at
+// the returned point on exit (first same as last), err is
+// the difference with the embedded 4th order solution
+vec3 rk45(vec3 y, float b, float h, inout vec3 k1, out vec3 err)
+{
+	vec3 k2 = differentiate(b, y + h * (1.0/5.0 * k1));
+	vec3 k3 = differentiate(b, y + h * (3.0/40.0 * k1 + 9.0/40.0 * k2));
+	vec3 k4 = differentiate(b, y + h * (44.0/45.0 * k1 - 56.0/15.0 * k2 + 32.0/9.0 * k3));
+	vec3 k5 = differentiate(b, y + h * (19372.0/6561.0 * k1 - 25360.0/2187.0 * k2
+		+ 64448.0/6561.0 * k3 - 212.0/729.0 * k4));
+	vec3 k6 = differentiate(b, y + h * (9017.0/3168.0 * k1 - 355.0/33.0 * k2
+		+ 46732.0/5247.0 * k3 + 49.0/176.0 * k4 - 5103.0/18656.0 * k5));
+	vec3 y5 = y + h * (35.0/384.0 * k1 + 500.0/1113.0 * k3 + 125.0/192.0 * k4
+		- 2187.0/6784.0 * k5 + 11.0/84.0 * k6);
+	vec3 k7 = differentiate(b, y5);
+	err = h * (71.0/57600.0 * k1 - 71.0/16695.0 * k3 + 71.0/1920.0 * k4
+		- 17253.0/339200.0 * k5 + 22.0/525.0 * k6 - 1.0/40.0 * k7);
+	k1 = k7;
+	return y5;
+}
+
+// Binet's equation, with u = 1/r and phi as the parameter
+// w = (u, du/dphi)
+// dw/dphi = (du/dphi, 3/2 rs u^2 - u)
+vec2 differentiate_binet(vec2 w)
+{
+	return vec2(w.y, w.x * (1.5 * scene.sch_radius * w.x - 1.0));
+}
+
+vec2 rk4_binet(vec2 w, float h)
+{
+	vec2 k1 = differentiate_binet(w             );
+	vec2 k2 = differentiate_binet(w + 0.5*h * k1);
+	vec2 k3 = differentiate_binet(w + 0.5*h * k2);
+	vec2 k4 = differentiate_binet(w +     h * k3);
+	return w + h * inv6 * (k1 + 2.0*k2 + 2.0*k3 + k4);
+}
+
 // Taken from http://lolengine.net/blog/2013/07/27/rgb-to-hsv-in-glsl.
 vec3 hsv2rgb(vec3 c)
 {
@@ -86,6 +151,336 @@ vec3 rotate_axis(vec3 axis, float angle, vec3 v)
 	return rodrigues_formula(axis, sin(angle), cos(angle), v);
 }
 
+// accumulates the disk along a step of duration h ending at y
+void sample_disk(vec3 y, float b, float h, vec3 orbital_axis, vec3 start_radial_n,
+	inout float light, inout float transmittance)
+{
+	float rs = scene.sch_radius;
+	float r = y.x;
+	float rho = 1.0 - rs / r;
+	float rm3 = 1.0f / (r * r * r);
+	float ds = rho * h * sqrt(1.0 + b * b * rm3 * rs);
+	vec3 radial = rotate_axis(orbital_axis, y.z, start_radial_n);
+	// world pos = mass origin + r * radial
+	float disk_angle = atan(dot(radial, scene.accr_z), dot(radial, scene.accr_x));
+	float ydisk = r * dot(radial, scene.accr_normal);
+	integrate_intensity(r, disk_angle, ydisk, light, transmittance, ds);
+}
+
+// no matter how you integrate, from an observer,
+// nothing reaches the event horizon
+// so we flush photons who are orbiting too close
+// inside, which also reduces the repetitions we see
+// in the photon sphere
+float r_limit()
+{
+	return scene.sch_radius * (1.0 + 1e-4);
+}
+
+// once outbound past scene.escape_r (0 disables it) and out
+// of reach of the disk the ray is almost straight, so
+// integration stops and escape_phi() gives where it ends up,
+// the expansion it uses is poor close to the periapsis
+bool escaping(vec3 y)
+{
+	return scene.escape_r > 0.0 && y.y > 0.5 && y.x >= scene.escape_r
+		&& (scene.accr_hide || y.x > scene.accr_max_r);
+}
+
+// phi at infinity of an escaping ray, integrating
+// dphi/du = 1/sqrt(1/b^2 - u^2 + rs u^3) from u = 1/r to 0
+// to first order in rs: with psi the angle to the radial
+// direction of the straight line continuing it (sin psi = b/r),
+// asin(b/r) - rs/(2b) * (1 - cos psi)^2 / cos psi
+float escape_phi(vec3 y, float b)
+{
+	float rs = scene.sch_radius;
+	float sin_psi = min(b / y.x, 1.0);
+	float cos_psi = sqrt(1.0 - sin_psi * sin_psi);
+	float sin3_psi = sin_psi * sin_psi * sin_psi;
+	float weak = 0.5 * rs * sin3_psi / (y.x * cos_psi * (1.0 + cos_psi) * (1.0 + cos_psi));
+	return y.z + asin(sin_psi) - weak;
+}
+
+vec3 integrate_rk4(vec3 y, float b, vec3 orbital_axis, vec3 start_radial_n,
+	inout float light, inout float transmittance)
+{
+	for (uint iter = 0; iter < scene.iterations && !escaping(y); iter++) {
+		vec3 next = rk4(y, b, scene.dt);
+		if (next.x <= r_limit()) {
+			transmittance = 0.0;
+			return next;
+		}
+		y = next;
+		if (!scene.accr_hide) {
+			sample_disk(y, b, scene.dt, orbital_axis, start_radial_n, light, transmittance);
+		}
+	}
+	return y;
+}
+
+// attempts a step of h, on success y and k1 are advanced and
+// the duration covered is returned, otherwise 0 is returned,
+// in both cases h becomes the next step size to try
+float rk45_step(inout vec3 y, float b, inout vec3 k1, inout float h)
+{
+	vec3 err;
+	vec3 k = k1;
+	vec3 next = rk45(y, b, h, k, err);
+	// r and phi errors are relative to the radius,
+	// dr/dt is a fraction of the speed of light
+	vec3 scale = scene.tolerance * vec3(y.x, 1.0, 1.0);
+	vec3 ratio3 = abs(err) / scale;
+	float ratio = max(ratio3.x, max(ratio3.y, ratio3.z));
+	if (!(ratio <= 1.0)) {
+		// also rejects NaNs from evaluating inside the horizon
+		float shrink = 0.9 * pow(ratio, -0.25);
+		h *= isnan(shrink) ? 0.1 : max(shrink, 0.1);
+		return 0.0;
+	}
+	float taken = h;
+	y = next;
+	k1 = k;
+	h *= clamp(0.9 * pow(max(ratio, 1e-10), -0.2), 0.2, 5.0);
+	return taken;
+}
+
+// a lower bound of how far y is from the disk, which lies within
+// accr_height of its plane and accr_max_r of the hole
+float disk_distance(vec3 y, vec3 orbital_axis, vec3 start_radial_n)
+{
+	vec3 radial = rotate_axis(orbital_axis, y.z, start_radial_n);
+	float off_plane = abs(y.x * dot(radial, scene.accr_normal)) - scene.accr_height;
+	return max(y.x - scene.accr_max_r - scene.accr_height, off_plane);
+}
+
+// integrates for the same duration as integrate_rk4() would,
+// with steps sized so the local error stays under scene.tolerance
+// and scene.iterations as the maximum number of attempted steps
+vec3 integrate_rk45(vec3 y, float b, vec3 orbital_axis, vec3 start_radial_n,
+	inout float light, inout float transmittance)
+{
+	float t_left = float(scene.iterations) * scene.dt;
+	float h = scene.dt;
+	vec3 k1 = differentiate(b, y);
+	for (uint iter = 0; iter < scene.iterations && t_left > 0.0 && !escaping(y); iter++) {
+		h = min(h, t_left);
+		// the disk is only sampled at the end of each step,
+		// so keep the original resolution where it may be crossed,
+		// rays are slower than light so they can't skip to it
+		if (!scene.accr_hide) {
+			h = min(h, max(scene.dt, disk_distance(y, orbital_axis, start_radial_n)));
+		}
+		float taken = rk45_step(y, b, k1, h);
+		if (taken == 0.0) {
+			continue;
+		}
+		if (y.x <= r_limit()) {
+			transmittance = 0.0;
+			return y;
+		}
+		t_left -= taken;
+		if (!scene.accr_hide) {
+			sample_disk(y, b, taken, orbital_axis, start_radial_n, light, transmittance);
+		}
+	}
+	return y;
+}
+
+// dr/dt = dr/dphi * dphi/dt = -du/dphi / u^2 * b rho u^2
+vec3 binet_to_t(vec2 w, float phi, float b)
+{
+	float rho = 1.0 - scene.sch_radius * w.x;
+	return vec3(1.0 / w.x, -b * rho * w.y, phi);
+}
+
+// integrates over phi with steps of scene.dphi, shrunk for rays
+// at a small angle psi to the radial direction (sin psi = b u)
+// which sweep little phi, down to where escape_phi() takes over: it
+// is first order in rs, so rays handed to it below escape_r are still
+// off by O((rs/r)^2)
+vec3 integrate_binet(vec3 y, float b, vec3 orbital_axis, vec3 start_radial_n,
+	inout float light, inout float transmittance, out bool escaped)
+{
+	float rs = scene.sch_radius;
+	float u_limit = 1.0 / r_limit();
+	float phi = y.z;
+	vec2 w = vec2(1.0 / y.x, -y.y / (b * (1.0 - rs / y.x)));
+	escaped = false;
+	for (uint iter = 0; iter < scene.iterations; iter++) {
+		float bu = b * w.x;
+		// nearly radial outbound rays end up where escape_phi() says,
+		// once past the disk like in escaping()
+		if (w.y < 0.0 && bu < 0.05 && (scene.accr_hide || 1.0 / w.x > scene.accr_max_r)) {
+			escaped = true;
+			break;
+		}
+		if (scene.escape_r > 0.0 && escaping(binet_to_t(w, phi, b))) {
+			escaped = true;
+			break;
+		}
+		float h = min(scene.dphi, 0.1 * bu);
+		if (!scene.accr_hide) {
+			// same duration bounds as integrate_rk45(), with dt = dphi / (b u^2 rho)
+			float gap = disk_distance(binet_to_t(w, phi, b), orbital_axis, start_radial_n);
+			h = min(h, bu * w.x * (1.0 - rs * w.x) * max(scene.dt, gap));
+		}
+		w = rk4_binet(w, h);
+		phi += h;
+		if (w.x >= u_limit) {
+			transmittance = 0.0;
+			break;
+		}
+		if (!scene.accr_hide) {
+			float dt = h / (bu * w.x * (1.0 - rs * w.x));
+			sample_disk(binet_to_t(w, phi, b), b, dt, orbital_axis, start_radial_n, light, transmittance);
+		}
+	}
+	return binet_to_t(w, phi, b);
+}
+
+// without the disk a ray only depends on u0 = rs/r0, on the
+// ratio s of b to its largest value r0/sqrt(1-u0) at r0 and on
+// whether it starts outbound, so it is tabulated once per render
+// as (phi at infinity, transmittance) in layers 0 (inbound) and
+// 1 (outbound). phi diverges around the critical impact parameter
+// like -log|s - s_crit|, so columns are spaced exponentially away
+// from s_crit in the middle, where it becomes linear, with smaller
+// s on the left half. Rows are spaced logarithmically in u0 from
+// lut_u_min, which is as far as it goes.
+const float lut_lambda = 12.0;
+const float lut_u_min = 1.0 / 1024.0;
+const float lut_escape_r = 50.0; // in units of rs
+const uint lut_max_steps = 4096;
+
+float lut_s_crit(float u0)
+{
+	return 1.5 * sqrt(3.0) * u0 * sqrt(1.0 - u0);
+}
+
+float lut_u0(float v)
+{
+	return pow(lut_u_min, 1.0 - v);
+}
+
+float lut_v(float u0)
+{
+	return 1.0 - log(u0) / log(lut_u_min);
+}
+
+float lut_s(float x, float u0)
+{
+	float s_crit = lut_s_crit(u0);
+	float t = abs(2.0 * x - 1.0);
+	float d = exp(lut_lambda * (t - 1.0));
+	return x < 0.5 ? s_crit * (1.0 - d) : s_crit + (1.0 - s_crit) * d;
+}
+
+// column coordinate of s, or -1 too close to s_crit to interpolate
+float lut_x(float s, float u0, float width)
+{
+	float s_crit = lut_s_crit(u0);
+	float side = s < s_crit ? s_crit : 1.0 - s_crit;
+	if (side <= 0.0) {
+		return -1.0;
+	}
+	float d = abs(s - s_crit) / side;
+	float t = 1.0 + log(d) / lut_lambda;
+	if (t * width < 4.0) {
+		return -1.0;
+	}
+	return s < s_crit ? 0.5 - 0.5 * t : 0.5 + 0.5 * t;
+}
+
+// runs the ray until it escapes or falls in, a transmittance
+// of 0.5 marks rays that did neither so they are never used
+vec2 lut_integrate(vec3 y, float b)
+{
+	float h = 0.1 * scene.sch_radius;
+	vec3 k1 = differentiate(b, y);
+	for (uint iter = 0; iter < lut_max_steps; iter++) {
+		if (y.y > 0.5 && y.x >= lut_escape_r * scene.sch_radius) {
+			return vec2(escape_phi(y, b), 1.0);
+		}
+		rk45_step(y, b, k1, h);
+		if (y.x <= r_limit()) {
+			return vec2(0.0, 0.0);
+		}
+	}
+	return vec2(0.0, 0.5);
+}
+
+void build_lut(ivec3 texel)
+{
+	ivec3 size = imageSize(lut_image);
+	if (any(greaterThanEqual(texel, size))) {
+		return;
+	}
+	float x = (float(texel.x) + 0.5) / float(size.x);
+	float u0 = lut_u0((float(texel.y) + 0.5) / float(size.y));
+	float s = lut_s(x, u0);
+	float rho = 1.0 - u0;
+	float r0 = scene.sch_radius / u0;
+	float b = s * r0 * inversesqrt(rho);
+	float dr_dt = (texel.z == 0 ? -1.0 : +1.0) * rho * sqrt(max(0.0, 1.0 - s * s));
+	vec2 phi_t = lut_integrate(vec3(r0, dr_dt, 0.0), b);
+	imageStore(lut_image, texel, vec4(phi_t, 0.0, 0.0));
+}
+
+// fetches (phi at infinity, transmittance) if it is tabulated
+bool lut_lookup(float r0, float b, bool outbound, out vec2 phi_t)
+{
+	vec3 size = vec3(textureSize(deflection_lut, 0));
+	float u0 = scene.sch_radius / r0;
+	float v = lut_v(u0);
+	if (!(v >= 0.5 / size.y && v <= 1.0 - 0.5 / size.y)) {
+		return false;
+	}
+	float s = b * sqrt(1.0 - u0) / r0;
+	float x = lut_x(s, u0, size.x);
+	if (x < 0.0) {
+		return false;
+	}
+	phi_t = texture(deflection_lut, vec3(x, v, outbound ? 1.0 : 0.0)).xy;
+	// captured and escaping rays got mixed
+	return phi_t.y == 0.0 || phi_t.y == 1.0;
+}
+
+// folds the lower half of the octahedron |x|+|y|+|z|=1
+// over the upper one, which projects onto the unit square
+vec2 oct_encode(vec3 ray)
+{
+	ray /= abs(ray.x) + abs(ray.y) + abs(ray.z);
+	vec2 e = ray.xy;
+	if (ray.z < 0.0) {
+		vec2 s = vec2(e.x >= 0.0 ? 1.0 : -1.0, e.y >= 0.0 ? 1.0 : -1.0);
+		e = (1.0 - abs(e.yx)) * s;
+	}
+	return e;
+}
+
+// 12 bits for each coordinate, offset so 0 is exact as with snorm, and
+// transmittance split over the low bits of both halves so that the
+// codec's 16 bit channels each change smoothly from frame to frame
+uint oct_pack(vec2 e, float transmittance)
+{
+	uvec2 q = uvec2(floor(clamp(e, -1.0, 1.0) * 2047.0 + 2048.5));
+	uint t = uint(floor(clamp(transmittance, 0.0, 1.0) * 255.0 + 0.5));
+	return q.x << 20 | (t >> 4) << 16 | q.y << 4 | (t & 15u);
+}
+
+vec4 pack_ray(vec3 ray, float transmittance, float light)
+{
+	if (oct48) {
+		return vec4(oct_encode(ray), transmittance, light);
+	}
+	if (floatBitsToInt(ray.z) < 0) {
+		return vec4(ray.xy, -transmittance, light);
+	} else {
+		return vec4(ray.xy, +transmittance, light);
+	}
+}
+
 vec4 trace(vec3 start_ray)
 {
 	vec3 ray = start_ray;
@@ -95,14 +490,8 @@ vec4 trace(vec3 start_ray)
 	vec3 orbital_axis = normalize(cross(start_radial, ray));
 	float r = length(start_radial);
 	float r0 = r;
-	// no matter how you integrate, from an observer,
-	// nothing reaches the event horizon
-	// so we flush photons who are orbiting too close
-	// inside, which also reduces the repetitions we see
-	// in the photon sphere
 	float rs = scene.sch_radius;
-	float r_limit = rs * (1.0 + 1e-4);
-	if (r <= r_limit) {
+	if (r <= r_limit()) {
 		return vec4(0.0);
 	}
 	float phi = 0;
@@ -136,28 +525,23 @@ vec4 trace(vec3 start_ray)
 			* rho / (1.0 + rho * tan_beta * tan_beta));
 	}
 
+	vec2 phi_t;
+	if (scene.accr_hide && scene.use_lut && lut_lookup(r0, b, dr_dt > 0.0, phi_t)) {
+		ray = rotate_axis(orbital_axis, phi_t.x, start_radial_n);
+		return pack_ray(ray, phi_t.y, 0.0);
+	}
+
 	vec3 y = vec3(r, dr_dt, phi);
 	float light = 0.0;
 	float transmittance = 1.0;
 
-	for (uint iter = 0; iter < scene.iterations; iter++) {
-		y = rk4(y, b, scene.dt);
-		r = y.x;
-		if (r <= r_limit) {
-			transmittance = 0.0;
-			break;
-		}
-		phi = y.z;
-		rho = 1.0 - rs / r;
-		float rm3 = 1.0f / (r * r * r);
-		float ds = rho * scene.dt * sqrt(1.0 + b * b * rm3 * rs);
-		vec3 radial = rotate_axis(orbital_axis, phi, start_radial_n);
-		// world pos = mass origin + r * radial
-		float disk_angle = atan(dot(radial, scene.accr_z), dot(radial, scene.accr_x));
-		float ydisk = r * dot(radial, scene.accr_normal);
-		if (!scene.accr_hide) {
-			integrate_intensity(r, disk_angle, ydisk, light, transmittance, ds);
-		}
+	bool escaped = false;
+	if (scene.integrator == INTEGRATOR_BINET && b > 0.0) {
+		y = integrate_binet(y, b, orbital_axis, start_radial_n, light, transmittance, escaped);
+	} else if (scene.integrator == INTEGRATOR_RK45) {
+		y = integrate_rk45(y, b, orbital_axis, start_radial_n, light, transmittance);
+	} else {
+		y = integrate_rk4(y, b, orbital_axis, start_radial_n, light, transmittance);
 	}
 
 	float sin_beta_crit = rs / r0 * 0.5 * sqrt(27.0) * sqrt(1.0 - rs / r0);
@@ -170,18 +554,18 @@ vec4 trace(vec3 start_ray)
 	r = y.x;
 	dr_dt = y.y;
 	phi = y.z;
-	vec3 end_radial  = rotate_axis(orbital_axis, phi, start_radial_n);
-	vec3 end_angular = cross(orbital_axis, end_radial);
-	pos = scene.sphere_pos + r * end_radial;
-	float dphi_dt;
-	float d2r_dt2;
-	ray_accel(r, b, dr_dt, dphi_dt, d2r_dt2);
-	ray = normalize(dr_dt * end_radial + r * dphi_dt * end_angular);
-	if (floatBitsToInt(ray.z) < 0) {
-		return vec4(ray.xy, -transmittance, light);
+	if (escaped || escaping(y)) {
+		ray = rotate_axis(orbital_axis, escape_phi(y, b), start_radial_n);
 	} else {
-		return vec4(ray.xy, +transmittance, light);
+		vec3 end_radial  = rotate_axis(orbital_axis, phi, start_radial_n);
+		vec3 end_angular = cross(orbital_axis, end_radial);
+		pos = scene.sphere_pos + r * end_radial;
+		float dphi_dt;
+		float d2r_dt2;
+		ray_accel(r, b, dr_dt, dphi_dt, d2r_dt2);
+		ray = normalize(dr_dt * end_radial + r * dphi_dt * end_angular);
 	}
+	return pack_ray(ray, transmittance, light);
 }
 
 vec3 rotate_quat(vec4 q, vec3 v)
@@ -189,16 +573,282 @@ vec3 rotate_quat(vec4 q, vec3 v)
 	return v + 2.0 * cross(q.xyz, q.w * v + cross(q.xyz, v));
 }
 
+// through a point of the screen in pixels, pixel i spans [i, i+1)
+vec3 start_ray(vec2 at)
+{
+	vec2 pixel = at * scene.inv_screen_width - 0.5;
+	return normalize(rotate_quat(scene.q_orientation, vec3(pixel, -scene.focal_length)));
+}
+
+// where in its pixel the ray stored for it starts: the corner when it
+// is traced once, the middle when it is an average over the pixel
+float pixel_center()
+{
+	return max_samples > 1 ? 0.5 : 0.0;
+}
+
+vec3 start_ray(ivec2 coord)
+{
+	return start_ray(vec2(coord) + pixel_center());
+}
+
+vec3 oct_decode(vec2 e)
+{
+	vec3 ray = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	if (ray.z < 0.0) {
+		vec2 s = vec2(ray.x >= 0.0 ? 1.0 : -1.0, ray.y >= 0.0 ? 1.0 : -1.0);
+		ray.xy = (1.0 - abs(ray.yx)) * s;
+	}
+	return normalize(ray);
+}
+
+// the octahedral coordinates and transmittance
+vec3 oct_unpack(uint word)
+{
+	vec2 e = (vec2(uvec2(word >> 20, word >> 4 & 0xfffu)) - 2048.0) / 2047.0;
+	return vec3(e, float((word >> 16 & 15u) << 4 | (word & 15u)) / 255.0);
+}
+
+// what pack_ray() stored for a pixel, earlier dispatches of the chunk
+// are made visible by a barrier and the images are bound read-write
+vec4 load_pixel(ivec3 texel)
+{
+	if (oct48) {
+		return vec4(oct_unpack(imageLoad(screen_ray, texel).x), imageLoad(screen_light, texel).x);
+	}
+	return imageLoad(screen, texel);
+}
+
+vec3 unpack_ray(vec4 p)
+{
+	if (oct48) {
+		return oct_decode(p.xy);
+	}
+	float z = sqrt(max(0.0, 1.0 - dot(p.xy, p.xy)));
+	return vec3(p.xy, p.z < 0.0 ? -z : z);
+}
+
+// the escape direction traced for a pixel of the first frame,
+// false unless the ray went through untouched (outside of the
+// image nothing was traced and it loads as fully absorbed)
+bool load_escape(ivec2 coord, out vec3 ray)
+{
+	vec4 p = load_pixel(ivec3(coord, 0));
+	ray = unpack_ray(p);
+	return abs(p.z) == 1.0 && p.w == 0.0;
+}
+
+uint hash(uint x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+// where in the pixel sample i goes: the pixel is cut in about as many
+// strata as there are samples per round and each round puts one sample
+// at a random place in each of them, the same for every frame so that
+// still parts of the picture stay still
+vec2 sample_offset(ivec2 coord, uint i)
+{
+	uint columns = uint(ceil(sqrt(float(samples))));
+	uint rows = (samples + columns - 1) / columns;
+	uint stratum = i % samples;
+	uint h = hash(uint(coord.x) ^ hash(uint(coord.y) ^ hash(i)));
+	vec2 jitter = vec2(h & 0xffffu, h >> 16) / 65536.0;
+	return (vec2(stratum % columns, stratum / columns) + jitter) / vec2(columns, rows);
+}
+
+// averages the rays over the pixel: transmittance and light as they
+// are, and the escape direction weighted by transmittance since that
+// is how much of the skybox shows through. Rounds of samples are added
+// while the standard error of the mean transmittance, light or
+// deflection is above sample_tolerance
 vec4 color(ivec2 coord)
 {
-	vec2 pixel = vec2(coord.x * scene.inv_screen_width - 0.5, coord.y * scene.inv_screen_width - 0.5);
-	vec3 start_ray = normalize(rotate_quat(scene.q_orientation, vec3(pixel, -scene.focal_length)));
-	return trace(start_ray);
+	if (max_samples == 1) {
+		return trace(start_ray(coord));
+	}
+	vec3 ray = vec3(0.0);
+	vec3 deflection = vec3(0.0);
+	float deflection2 = 0.0;
+	vec2 light = vec2(0.0);
+	vec2 light2 = vec2(0.0);
+	vec3 last_ray;
+	uint n = 0;
+	for (;;) {
+		for (uint k = 0; k < samples; ++k, ++n) {
+			vec3 start = start_ray(vec2(coord) + sample_offset(coord, n));
+			vec4 p = trace(start);
+			last_ray = unpack_ray(p);
+			vec2 l = vec2(abs(p.z), p.w);
+			vec3 d = last_ray - start;
+			ray += l.x * last_ray;
+			deflection += l.x * d;
+			deflection2 += l.x * dot(d, d);
+			light += l;
+			light2 += l * l;
+		}
+		if (n + samples > max_samples) {
+			break;
+		}
+		vec2 mean = light / float(n);
+		vec2 variance = light2 / float(n) - mean * mean;
+		float spread = 0.0;
+		if (light.x > 0.0) {
+			vec3 mean_d = deflection / light.x;
+			spread = deflection2 / light.x - dot(mean_d, mean_d);
+		}
+		if (n > 1 && max(max(variance.x, variance.y), spread) < sample_tolerance * sample_tolerance * float(n)) {
+			break;
+		}
+	}
+	if (length(ray) > 0.0) {
+		last_ray = normalize(ray);
+	}
+	return pack_ray(last_ray, light.x / float(n), light.y / float(n));
 }
 
-void main()
+// the disk is placed relative to the hole, so it is where the first
+// frame saw it if none of its parameters changed since
+bool same_disk(scene_state a, scene_state b)
 {
-	ivec2 coord = px_base + ivec2(gl_GlobalInvocationID.xy);
-	imageStore(screen, coord, color(coord));
+	return a.accr_hide == b.accr_hide && (a.accr_hide
+		|| (a.accr_normal == b.accr_normal && a.accr_height == b.accr_height
+		&& a.accr_min_r == b.accr_min_r && a.accr_max_r == b.accr_max_r
+		&& a.accr_abso == b.accr_abso && a.accr_light == b.accr_light
+		&& a.accr_light2 == b.accr_light2));
 }
 
+// interpolates the escape direction of the ray through coord from the
+// first frame of the chunk, where the same direction from its camera
+// landed between four pixels that all went through untouched. Far
+// from the hole the deflection is about 2 rs/b, so reusing it is off
+// by about as much as that changes with the camera moving relative
+// to the hole and with rs, plus how far the four pixels are from
+// interpolating linearly
+bool reproject_pixel(ivec2 coord, out vec4 pixel)
+{
+	scene_state key = scenes[chunk_start];
+	if (scene.reproject_tolerance <= 0.0 || !same_disk(scene, key)) {
+		return false;
+	}
+	float rs = scene.sch_radius;
+	vec3 rel = scene.cam_pos - scene.sphere_pos;
+	vec3 key_rel = key.cam_pos - key.sphere_pos;
+	vec3 ray = start_ray(coord);
+	// the straight line misses the photon sphere by far, and once the
+	// camera moved relative to the hole it is not the ray traced before
+	// so it must also miss the disk, bending brings it closer by about rs
+	float b = length(cross(rel, ray));
+	float b_crit = 1.5 * sqrt(3.0) * max(rs, key.sch_radius);
+	if (b < 2.0 * b_crit || (!scene.accr_hide && rel != key_rel
+	 && b - rs < scene.accr_max_r + scene.accr_height)) {
+		return false;
+	}
+
+	vec4 q = vec4(-key.q_orientation.xyz, key.q_orientation.w);
+	vec3 v = rotate_quat(q, ray);
+	if (v.z >= 0.0) {
+		return false;
+	}
+	vec2 p = (-key.focal_length * v.xy / v.z + 0.5) / key.inv_screen_width - pixel_center();
+	ivec2 base = ivec2(floor(p));
+	vec2 f = p - vec2(base);
+	vec3 r00, r10, r01, r11;
+	if (!(load_escape(base, r00) && load_escape(base + ivec2(1, 0), r10)
+	   && load_escape(base + ivec2(0, 1), r01) && load_escape(base + ivec2(1, 1), r11))) {
+		return false;
+	}
+	// how far the four are from varying linearly across the pixels
+	float bend = length(r00 + r11 - r10 - r01);
+
+	// moving along the ray leaves the straight line where it was
+	float moved = length(cross(rel - key_rel, ray));
+	float err = 2.0 * (rs * moved / b + abs(rs - key.sch_radius)) / b + bend;
+	if (!(err < scene.reproject_tolerance)) {
+		return false;
+	}
+	vec3 escape = mix(mix(r00, r10, f.x), mix(r01, r11, f.x), f.y);
+	pixel = pack_ray(normalize(escape), 1.0, 0.0);
+	return true;
+}
+
+// interpolates a pixel between the four traced corners of its cell
+// of the grid, from the deflection (how far the ray ends up from where
+// it started), transmittance and light there, if the error that makes
+// is small: that is an eighth of how much they bend along the grid
+// and a quarter of their twist across the cell, measured with the
+// cells around it. Features smaller than a cell that none of the
+// traced pixels caught are lost.
+bool refine_pixel(ivec2 coord, uint frame, out vec4 pixel)
+{
+	ivec2 step = ivec2(refine_step);
+	ivec2 cell = coord / step * step;
+	ivec2 size = oct48 ? imageSize(screen_ray).xy : imageSize(screen).xy;
+	if (any(lessThan(cell - step, ivec2(0))) || any(greaterThanEqual(cell + 2 * step, size))) {
+		return false;
+	}
+	// [y][x] from one cell before to one after
+	vec3 deflection[4][4];
+	vec2 light[4][4];
+	for (int y = 0; y < 4; ++y) {
+		for (int x = 0; x < 4; ++x) {
+			ivec2 corner = cell + step * ivec2(x - 1, y - 1);
+			vec4 p = load_pixel(ivec3(corner, frame));
+			deflection[y][x] = unpack_ray(p) - start_ray(corner);
+			light[y][x] = vec2(abs(p.z), p.w);
+		}
+	}
+	float bend = 0.0;
+	for (int y = 1; y < 3; ++y) {
+		for (int x = 1; x < 3; ++x) {
+			vec3 dx = deflection[y][x-1] - 2.0 * deflection[y][x] + deflection[y][x+1];
+			vec3 dy = deflection[y-1][x] - 2.0 * deflection[y][x] + deflection[y+1][x];
+			vec2 lx = light[y][x-1] - 2.0 * light[y][x] + light[y][x+1];
+			vec2 ly = light[y-1][x] - 2.0 * light[y][x] + light[y+1][x];
+			bend = max(bend, max(max(length(dx), length(dy)), max(max(abs(lx.x), abs(lx.y)), max(abs(ly.x), abs(ly.y)))));
+		}
+	}
+	vec3 twist_d = deflection[1][1] + deflection[2][2] - deflection[1][2] - deflection[2][1];
+	vec2 twist_l = abs(light[1][1] + light[2][2] - light[1][2] - light[2][1]);
+	float twist = max(length(twist_d), max(twist_l.x, twist_l.y));
+	if (!(0.125 * bend + 0.25 * twist < refine_tolerance)) {
+		return false;
+	}
+
+	vec2 f = vec2(coord - cell) / vec2(step);
+	vec3 d = mix(mix(deflection[1][1], deflection[1][2], f.x), mix(deflection[2][1], deflection[2][2], f.x), f.y);
+	vec2 l = mix(mix(light[1][1], light[1][2], f.x), mix(light[2][1], light[2][2], f.x), f.y);
+	pixel = pack_ray(normalize(start_ray(coord) + d), l.x, l.y);
+	return true;
+}
+
+void main()
+{
+	if (lut_pass) {
+		scene = scenes[lut_scene];
+		build_lut(ivec3(gl_GlobalInvocationID));
+		return;
+	}
+	uint frame = frame_offset + gl_GlobalInvocationID.z;
+	scene = scenes[chunk_start + frame];
+	ivec2 coord = px_base + ivec2(grid_step * gl_GlobalInvocationID.xy);
+	if (refine_step > 1 && coord % ivec2(refine_step) == ivec2(0)) {
+		return;
+	}
+	vec4 pixel;
+	if (!(reproject && reproject_pixel(coord, pixel))
+	 && !(refine_step > 1 && refine_pixel(coord, frame, pixel))) {
+		pixel = color(coord);
+	}
+	if (oct48) {
+		imageStore(screen_ray, ivec3(coord, frame), uvec4(oct_pack(pixel.xy, pixel.z)));
+		imageStore(screen_light, ivec3(coord, frame), pixel.wwww);
+	} else {
+		imageStore(screen, ivec3(coord, frame), pixel);
+	}
+}
@@ -0,0 +1,487 @@
+#include <immintrin.h>
+#include "cpu_trace.hpp"
+
+// only the kernels below are built for AVX2 and FMA: the library code
+// that is included above and inlined here stays baseline, or the linker
+// could keep an AVX2 copy of it for the rest of the program.
+// main checks cpu_trace_supported() before anything below runs
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx2,fma"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#endif
+
+// the rays of a packet are the lanes of f8 (SoA), so the code below
+// reads like compute.glsl with f8 for float and v3 for vec3, except
+// that branches become masks: lanes that are done stop being updated
+struct f8
+{
+	__m256 v;
+
+	f8() = default;
+	f8(__m256 v) : v{v} {}
+	f8(float x) : v{_mm256_set1_ps(x)} {}
+};
+
+struct m8
+{
+	__m256 v;
+};
+
+static inline f8 operator+(f8 a, f8 b) { return _mm256_add_ps(a.v, b.v); }
+static inline f8 operator-(f8 a, f8 b) { return _mm256_sub_ps(a.v, b.v); }
+static inline f8 operator*(f8 a, f8 b) { return _mm256_mul_ps(a.v, b.v); }
+static inline f8 operator/(f8 a, f8 b) { return _mm256_div_ps(a.v, b.v); }
+static inline f8 operator-(f8 a) { return _mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f)); }
+
+static inline m8 operator<(f8 a, f8 b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; }
+static inline m8 operator<=(f8 a, f8 b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ) }; }
+static inline m8 operator>(f8 a, f8 b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ) }; }
+static inline m8 operator>=(f8 a, f8 b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ) }; }
+static inline m8 operator&(m8 a, m8 b) { return { _mm256_and_ps(a.v, b.v) }; }
+static inline m8 operator|(m8 a, m8 b) { return { _mm256_or_ps(a.v, b.v) }; }
+static inline m8 operator!(m8 a) { return { _mm256_xor_ps(a.v, _mm256_castsi256_ps(_mm256_set1_epi32(-1))) }; }
+
+static inline bool any(m8 m) { return _mm256_movemask_ps(m.v) != 0; }
+// a where m is set, b elsewhere
+static inline f8 select(m8 m, f8 a, f8 b) { return _mm256_blendv_ps(b.v, a.v, m.v); }
+
+static inline f8 fma(f8 a, f8 b, f8 c) { return _mm256_fmadd_ps(a.v, b.v, c.v); }
+static inline f8 sqrt(f8 a) { return _mm256_sqrt_ps(a.v); }
+static inline f8 inversesqrt(f8 a) { return 1.0f / sqrt(a); }
+static inline f8 abs(f8 a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+static inline f8 min(f8 a, f8 b) { return _mm256_min_ps(a.v, b.v); }
+static inline f8 max(f8 a, f8 b) { return _mm256_max_ps(a.v, b.v); }
+static inline f8 clamp(f8 x, f8 lo, f8 hi) { return min(max(x, lo), hi); }
+static inline f8 sign(f8 x) { return select(x > 0.0f, 1.0f, select(x < 0.0f, -1.0f, 0.0f)); }
+
+static inline f8 smoothstep(f8 edge0, f8 edge1, f8 x)
+{
+	const f8 t = clamp((x - edge0) / (edge1 - edge0), 0.0f, 1.0f);
+	return t * t * (3.0f - 2.0f * t);
+}
+
+// x = q pi/2 + r with |r| <= pi/4, pi/2 is split in three
+// so that q pi/2 is exact (Cody-Waite), then the minimax
+// polynomials of cephes' sinf and cosf on r
+static void sincos(f8 x, f8 &s, f8 &c)
+{
+	const f8 q = _mm256_round_ps((x * 0.63661977f).v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	f8 r = fma(q, -1.5703125f, x);
+	r = fma(q, -4.837512969970703125e-4f, r);
+	r = fma(q, -7.54978995489188216e-8f, r);
+	const f8 r2 = r * r;
+	f8 ps = fma(r2, -1.9515295891e-4f, 8.3321608736e-3f);
+	ps = fma(ps, r2, -1.6666654611e-1f);
+	const f8 sin_r = fma(ps * r2, r, r);
+	f8 pc = fma(r2, 2.443315711809948e-5f, -1.388731625493765e-3f);
+	pc = fma(pc, r2, 4.166664568298827e-2f);
+	const f8 cos_r = fma(pc * r2, r2, fma(r2, -0.5f, 1.0f));
+
+	// odd quadrants swap sin and cos, sin is negative
+	// in quadrants 2 and 3, cos in quadrants 1 and 2
+	const __m256i qi = _mm256_cvtps_epi32(q.v);
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256i two = _mm256_set1_epi32(2);
+	const m8 swap{ _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(qi, one), one)) };
+	const __m256i sin_sign = _mm256_slli_epi32(_mm256_and_si256(qi, two), 30);
+	const __m256i cos_sign = _mm256_slli_epi32(_mm256_and_si256(_mm256_add_epi32(qi, one), two), 30);
+	s = _mm256_xor_ps(select(swap, cos_r, sin_r).v, _mm256_castsi256_ps(sin_sign));
+	c = _mm256_xor_ps(select(swap, sin_r, cos_r).v, _mm256_castsi256_ps(cos_sign));
+}
+
+// only done once per ray, lane by lane is good enough
+static f8 asin(f8 x)
+{
+	alignas(32) float lanes[8];
+	_mm256_store_ps(lanes, x.v);
+	for (auto &lane: lanes) {
+		lane = std::asin(lane);
+	}
+	return _mm256_load_ps(lanes);
+}
+
+struct v3
+{
+	f8 x, y, z;
+};
+
+static inline v3 splat(const float *v) { return { v[0], v[1], v[2] }; }
+static inline v3 operator+(const v3 &a, const v3 &b) { return { a.x + b.x, a.y + b.y, a.z + b.z }; }
+static inline v3 operator-(const v3 &a, const v3 &b) { return { a.x - b.x, a.y - b.y, a.z - b.z }; }
+static inline v3 operator*(f8 s, const v3 &a) { return { s * a.x, s * a.y, s * a.z }; }
+static inline f8 dot(const v3 &a, const v3 &b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+static inline v3 normalize(const v3 &a) { return inversesqrt(dot(a, a)) * a; }
+
+static inline v3 cross(const v3 &a, const v3 &b)
+{
+	return { a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x };
+}
+
+static inline v3 select(m8 m, const v3 &a, const v3 &b)
+{
+	return { select(m, a.x, b.x), select(m, a.y, b.y), select(m, a.z, b.z) };
+}
+
+static void ray_accel(const cpu_scene &scene, f8 r, f8 b, f8 dr_dt, f8 &dphi_dt, f8 &d2r_dt2)
+{
+	const f8 rs = scene.sch_radius;
+	const f8 rho = 1.0f - rs / r;
+	const f8 rm2 = 1.0f / (r * r);
+	dphi_dt = b * rm2 * rho;
+	d2r_dt2 = rho * rm2 * (rs * dr_dt * dr_dt + rho * b * b / r * (rho - rs * 0.5f / r));
+}
+
+// y = (r, dr/dt, phi)
+// dy/dt = (dr/dt, d2r/dt2, dphi/dt)
+static v3 differentiate(const cpu_scene &scene, f8 b, const v3 &y)
+{
+	v3 dy_dt;
+	ray_accel(scene, y.x, b, y.y, dy_dt.z, dy_dt.y);
+	dy_dt.x = y.y;
+	return dy_dt;
+}
+
+static v3 rk4(const cpu_scene &scene, const v3 &y, f8 b, f8 h)
+{
+	const f8 half_h = 0.5f * h;
+	const v3 k1 = differentiate(scene, b, y);
+	const v3 k2 = differentiate(scene, b, y + half_h * k1);
+	const v3 k3 = differentiate(scene, b, y + half_h * k2);
+	const v3 k4 = differentiate(scene, b, y + h * k3);
+	return y + (h * (1.0f / 6.0f)) * (k1 + 2.0f * k2 + 2.0f * k3 + k4);
+}
+
+static void integrate_intensity(const cpu_scene &scene, f8 r, f8 y, f8 &i, f8 &transmittance, f8 h)
+{
+	const float r0 = -1.0f * scene.accr_min_r;
+	const float y0 = scene.accr_height / ((scene.accr_max_r - r0) * (scene.accr_max_r - r0));
+	const f8 y_bound = y0 * (r - r0) * (r - r0);
+	const f8 y_modulate = 1.0f - smoothstep(0.0f, y_bound * y_bound, y * y);
+	f8 r_modulate = 1.0f - smoothstep(scene.accr_min_r, scene.accr_max_r, r);
+	const f8 in_disk = y_modulate * r_modulate;
+	const f8 l0 = scene.accr_light * (1.0f - scene.accr_min_r * scene.accr_light2 / r);
+	f8 density = in_disk * r_modulate;
+	const m8 outside = (r < scene.accr_min_r) | (r > scene.accr_max_r) | (abs(y) > scene.accr_height);
+	r_modulate = select(outside, 0.0f, r_modulate);
+	density = select(outside, 0.0f, density);
+	const f8 local_light = density * r_modulate / l0;
+	const f8 local_absorbance = density * scene.accr_abso;
+	i = max(0.0f, i + h * transmittance * local_light);
+	transmittance = transmittance + h * -local_absorbance * transmittance;
+}
+
+static v3 rotate_axis(const v3 &axis, f8 angle, const v3 &v)
+{
+	f8 sina, cosa;
+	sincos(angle, sina, cosa);
+	return cosa * v + sina * cross(axis, v) + ((1.0f - cosa) * dot(axis, v)) * axis;
+}
+
+// accumulates the disk along a step of duration h ending at y
+static void sample_disk(const cpu_scene &scene, const v3 &y, f8 b, f8 h,
+	const v3 &orbital_axis, const v3 &start_radial_n, f8 &light, f8 &transmittance)
+{
+	const f8 rs = scene.sch_radius;
+	const f8 r = y.x;
+	const f8 rho = 1.0f - rs / r;
+	const f8 rm3 = 1.0f / (r * r * r);
+	const f8 ds = rho * h * sqrt(1.0f + b * b * rm3 * rs);
+	const v3 radial = rotate_axis(orbital_axis, y.z, start_radial_n);
+	// the angle around the disk does not change the intensity
+	const f8 ydisk = r * dot(radial, splat(scene.accr_normal));
+	integrate_intensity(scene, r, ydisk, light, transmittance, ds);
+}
+
+static float r_limit(const cpu_scene &scene)
+{
+	return scene.sch_radius * (1.0f + 1e-4f);
+}
+
+static m8 escaping(const cpu_scene &scene, const v3 &y)
+{
+	if (!(scene.escape_r > 0.0f)) {
+		return { _mm256_setzero_ps() };
+	}
+	const m8 past = (y.y > 0.5f) & (y.x >= scene.escape_r);
+	return scene.accr_hide ? past : past & (y.x > scene.accr_max_r);
+}
+
+static f8 escape_phi(const cpu_scene &scene, const v3 &y, f8 b)
+{
+	const f8 rs = scene.sch_radius;
+	const f8 sin_psi = min(b / y.x, 1.0f);
+	const f8 cos_psi = sqrt(1.0f - sin_psi * sin_psi);
+	const f8 sin3_psi = sin_psi * sin_psi * sin_psi;
+	const f8 weak = 0.5f * rs * sin3_psi / (y.x * cos_psi * (1.0f + cos_psi) * (1.0f + cos_psi));
+	return y.z + asin(sin_psi) - weak;
+}
+
+static v3 integrate_rk4(const cpu_scene &scene, v3 y, f8 b, const v3 &orbital_axis,
+	const v3 &start_radial_n, f8 &light, f8 &transmittance)
+{
+	const f8 limit = r_limit(scene);
+	m8 active = !escaping(scene, y);
+	for (std::uint32_t iter = 0; iter < scene.iterations && any(active); ++iter) {
+		const v3 next = rk4(scene, y, b, scene.dt);
+		const m8 fell = active & (next.x <= limit);
+		transmittance = select(fell, 0.0f, transmittance);
+		y = select(active, next, y);
+		active = active & !fell;
+		if (!scene.accr_hide) {
+			f8 l = light;
+			f8 t = transmittance;
+			sample_disk(scene, y, b, scene.dt, orbital_axis, start_radial_n, l, t);
+			light = select(active, l, light);
+			transmittance = select(active, t, transmittance);
+		}
+		active = active & !escaping(scene, y);
+	}
+	return y;
+}
+
+// folds the lower half of the octahedron |x|+|y|+|z|=1
+// over the upper one, which projects onto the unit square
+static void oct_encode(v3 ray, f8 &ex, f8 &ey)
+{
+	const f8 n = 1.0f / (abs(ray.x) + abs(ray.y) + abs(ray.z));
+	ray = n * ray;
+	const f8 sx = select(ray.x >= 0.0f, 1.0f, -1.0f);
+	const f8 sy = select(ray.y >= 0.0f, 1.0f, -1.0f);
+	const m8 lower = ray.z < 0.0f;
+	ex = select(lower, (1.0f - abs(ray.y)) * sx, ray.x);
+	ey = select(lower, (1.0f - abs(ray.x)) * sy, ray.y);
+}
+
+static void pack_ray(const v3 &ray, f8 transmittance, f8 light, bool oct48, f8 *out)
+{
+	if (oct48) {
+		oct_encode(ray, out[0], out[1]);
+		out[2] = transmittance;
+	} else {
+		out[0] = ray.x;
+		out[1] = ray.y;
+		// the sign bit of ray.z, -0.0 included
+		out[2] = _mm256_xor_ps(transmittance.v, _mm256_and_ps(ray.z.v, _mm256_set1_ps(-0.0f)));
+	}
+	out[3] = light;
+}
+
+static void trace(const cpu_scene &scene, const v3 &start_ray, bool oct48, f8 *out)
+{
+	v3 ray = start_ray;
+	const v3 start_radial = splat(scene.cam_pos) - splat(scene.sphere_pos);
+	const v3 start_radial_n = normalize(start_radial);
+	const v3 orbital_axis = normalize(cross(start_radial, ray));
+	// the camera is the same for all the rays
+	float r0 = 0.0f;
+	for (size_t i = 0; i < 3; ++i) {
+		const float d = scene.cam_pos[i] - scene.sphere_pos[i];
+		r0 += d * d;
+	}
+	r0 = std::sqrt(r0);
+	const float rs = scene.sch_radius;
+	if (r0 <= r_limit(scene)) {
+		for (size_t c = 0; c < 4; ++c) {
+			out[c] = 0.0f;
+		}
+		return;
+	}
+
+	// see trace() in compute.glsl for the initial conditions
+	const v3 start_angular_n = cross(orbital_axis, start_radial_n);
+	const f8 dev_radial = dot(ray, start_radial_n);
+	const f8 dev_angular = dot(ray, start_angular_n);
+	const float rho = 1.0f - rs / r0;
+	const f8 sin_beta = inversesqrt(1.0f + dev_radial * dev_radial / (dev_angular * dev_angular));
+	const f8 cot_beta = dev_radial / dev_angular;
+	const f8 is = inversesqrt(rho + cot_beta * cot_beta);
+	const f8 tan_beta = dev_angular / dev_radial;
+	const f8 rho_tan2 = rho * tan_beta * tan_beta;
+	const f8 tis = abs(tan_beta) * inversesqrt(1.0f + rho_tan2);
+	const m8 steep = sin_beta > 0.707f;
+	const f8 b = select(steep, r0 * is, r0 * tis);
+	f8 dr_dt = select(steep, is * rho * cot_beta,
+		sign(dev_radial) * rho * sqrt(1.0f - tan_beta * tan_beta * rho / (1.0f + rho_tan2)));
+
+	v3 y = { r0, dr_dt, 0.0f };
+	f8 light = 0.0f;
+	f8 transmittance = 1.0f;
+	y = integrate_rk4(scene, y, b, orbital_axis, start_radial_n, light, transmittance);
+
+	const f8 r = y.x;
+	dr_dt = y.y;
+	const v3 escape_ray = rotate_axis(orbital_axis, escape_phi(scene, y, b), start_radial_n);
+	const v3 end_radial = rotate_axis(orbital_axis, y.z, start_radial_n);
+	const v3 end_angular = cross(orbital_axis, end_radial);
+	f8 dphi_dt, d2r_dt2;
+	ray_accel(scene, r, b, dr_dt, dphi_dt, d2r_dt2);
+	ray = normalize(dr_dt * end_radial + (r * dphi_dt) * end_angular);
+	ray = select(escaping(scene, y), escape_ray, ray);
+	pack_ray(ray, transmittance, light, oct48, out);
+}
+
+static v3 rotate_quat(const float *q, const v3 &v)
+{
+	const v3 qv = splat(q);
+	return v + 2.0f * cross(qv, q[3] * v + cross(qv, v));
+}
+
+// the 8 pixels from (x, y) on the row
+static void trace_packet(const cpu_scene &scene, size_t x, size_t y, bool oct48, f8 *out)
+{
+	const f8 lane = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+	const f8 px = (float(x) + lane) * scene.inv_screen_width - 0.5f;
+	const f8 py = float(y) * scene.inv_screen_width - 0.5f;
+	const v3 start_ray = normalize(rotate_quat(scene.q_orientation, { px, py, -scene.focal_length }));
+	trace(scene, start_ray, oct48, out);
+}
+
+// the `n` pixels of the packet that fall within the row, as
+// four floats each, so that f8 does not leave the kernels
+static void trace_pixels(const cpu_scene &scene, size_t x, size_t y, bool oct48, float *row, size_t n)
+{
+	f8 out[4];
+	trace_packet(scene, x, y, oct48, out);
+	alignas(32) float lanes[4][8];
+	for (size_t c = 0; c < 4; ++c) {
+		_mm256_store_ps(lanes[c], out[c].v);
+	}
+	for (size_t i = 0; i < n; ++i) {
+		for (size_t c = 0; c < 4; ++c) {
+			row[4 * (x + i) + c] = lanes[c][i];
+		}
+	}
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+
+bool cpu_trace_supported()
+{
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+
+static constexpr size_t tile_width = 32;
+static constexpr size_t tile_height = 8;
+
+cpu_tracer::cpu_tracer(unsigned threads)
+	: n_threads{std::max(threads, 1u)}, current{}, generation{0}, pending{0}, quit{false}
+{
+	ranges = std::make_unique<tile_range[]>(n_threads);
+	workers = std::make_unique<std::thread[]>(n_threads);
+	for (unsigned t = 0; t < n_threads; ++t) {
+		ranges[t].begin = ranges[t].end = 0;
+		workers[t] = std::thread{&cpu_tracer::work, this, t};
+	}
+}
+
+cpu_tracer::~cpu_tracer()
+{
+	{
+		std::lock_guard guard{lock};
+		quit = true;
+	}
+	wake.notify_all();
+	for (unsigned t = 0; t < n_threads; ++t) {
+		workers[t].join();
+	}
+}
+
+void cpu_tracer::trace_chunk(const cpu_scene *scenes, size_t frame_count,
+	size_t width, size_t height, bool oct48, float *pixels)
+{
+	const size_t columns = (width + tile_width - 1) / tile_width;
+	const size_t rows = (height + tile_height - 1) / tile_height;
+	const size_t n_tiles = frame_count * rows * columns;
+	{
+		std::lock_guard guard{lock};
+		assert(pending == 0);
+		current = job{scenes, width, height, oct48, pixels};
+		for (unsigned t = 0; t < n_threads; ++t) {
+			std::lock_guard range_guard{ranges[t].lock};
+			ranges[t].begin = n_tiles * t / n_threads;
+			ranges[t].end = n_tiles * (t + 1) / n_threads;
+		}
+		pending = n_threads;
+		++generation;
+	}
+	wake.notify_all();
+	std::unique_lock guard{lock};
+	done.wait(guard, [this] { return pending == 0; });
+}
+
+bool cpu_tracer::take_tile(unsigned self, size_t &tile)
+{
+	{
+		tile_range &own = ranges[self];
+		std::lock_guard guard{own.lock};
+		if (own.begin < own.end) {
+			tile = own.begin++;
+			return true;
+		}
+	}
+	for (unsigned k = 1; k < n_threads; ++k) {
+		tile_range &victim = ranges[(self + k) % n_threads];
+		size_t begin, end;
+		{
+			std::lock_guard guard{victim.lock};
+			if (victim.begin >= victim.end) {
+				continue;
+			}
+			const size_t left = victim.end - victim.begin;
+			end = victim.end;
+			begin = victim.end = end - (left + 1) / 2;
+		}
+		tile_range &own = ranges[self];
+		std::lock_guard guard{own.lock};
+		tile = begin;
+		own.begin = begin + 1;
+		own.end = end;
+		return true;
+	}
+	return false;
+}
+
+void cpu_tracer::trace_tile(size_t tile)
+{
+	const job &j = current;
+	const size_t columns = (j.width + tile_width - 1) / tile_width;
+	const size_t rows = (j.height + tile_height - 1) / tile_height;
+	const size_t frame = tile / (rows * columns);
+	const size_t x0 = tile % columns * tile_width;
+	const size_t y0 = tile / columns % rows * tile_height;
+	const cpu_scene &scene = j.scenes[frame];
+	for (size_t y = y0; y < std::min(y0 + tile_height, j.height); ++y) {
+		float *row = j.pixels + 4 * (frame * j.height + y) * j.width;
+		for (size_t x = x0; x < std::min(x0 + tile_width, j.width); x += 8) {
+			trace_pixels(scene, x, y, j.oct48, row, std::min<size_t>(8, j.width - x));
+		}
+	}
+}
+
+void cpu_tracer::work(unsigned self)
+{
+	std::unique_lock guard{lock};
+	unsigned seen = 0;
+	for (;;) {
+		wake.wait(guard, [&] { return quit || generation != seen; });
+		if (quit) {
+			return;
+		}
+		seen = generation;
+		guard.unlock();
+		size_t tile;
+		while (take_tile(self, tile)) {
+			trace_tile(tile);
+		}
+		guard.lock();
+		if (--pending == 0) {
+			done.notify_all();
+		}
+	}
+}
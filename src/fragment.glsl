@@ -1,11 +1,14 @@
 #version 430 core
 
-uniform layout(binding=0) sampler2DArray screen0;
-uniform layout(binding=1) sampler2DArray screen1;
+uniform layout(binding=0) sampler2DArray screen;
 uniform layout(location=2) float frame;
-uniform layout(location=3) float select;
-uniform layout(binding=4) samplerCube skybox;
+uniform layout(location=4, binding=4) samplerCube skybox;
 uniform layout(location=5) vec3 exponents;
+// the ray is octahedral and packed with transmittance
+// in screen_ray, and light is in screen_light
+uniform layout(location=6) bool oct48;
+uniform layout(binding=1) usampler2DArray screen_ray;
+uniform layout(binding=5) sampler2DArray screen_light;
 in vec2 uv;
 out vec4 f_color;
 
@@ -15,6 +18,39 @@ float sgn(float x)
 	return uintBitsToFloat(0x3f800000 | (floatBitsToUint(x) & (1u << 31)));
 }
 
+vec3 oct_decode(vec2 e)
+{
+	vec3 ray = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	float fold = max(-ray.z, 0.0);
+	ray.x += ray.x >= 0.0 ? -fold : fold;
+	ray.y += ray.y >= 0.0 ? -fold : fold;
+	return normalize(ray);
+}
+
+// what oct_unpack() in compute.glsl returns
+vec3 oct_unpack(uint word)
+{
+	vec2 e = (vec2(uvec2(word >> 20, word >> 4 & 0xfffu)) - 2048.0) / 2047.0;
+	return vec3(e, float((word >> 16 & 15u) << 4 | (word & 15u)) / 255.0);
+}
+
+// integer textures aren't filtered, this is GL_LINEAR
+// on the octahedral coordinates and transmittance
+vec3 sample_oct(vec3 coord)
+{
+	ivec3 size = textureSize(screen_ray, 0);
+	vec2 p = coord.xy * vec2(size.xy) - 0.5;
+	vec2 f = fract(p);
+	ivec2 base = ivec2(floor(p));
+	int layer = clamp(int(floor(coord.z + 0.5)), 0, size.z - 1);
+	vec3 s[4];
+	for (int i = 0; i < 4; ++i) {
+		ivec2 texel = clamp(base + ivec2(i & 1, i >> 1), ivec2(0), size.xy - 1);
+		s[i] = oct_unpack(texelFetch(screen_ray, ivec3(texel, layer), 0).x);
+	}
+	return mix(mix(s[0], s[1], f.x), mix(s[2], s[3], f.x), f.y);
+}
+
 vec3 light_shift(float intensity)
 {
 	return pow(vec3(intensity), exponents);
@@ -23,13 +59,21 @@ vec3 light_shift(float intensity)
 void main()
 {
 	vec3 coord = vec3(uv, frame);
-	vec4 color0 = texture(screen0, coord);
-	vec4 color1 = texture(screen1, coord);
-	vec4 color = mix(color0, color1, select);
-	vec3 ray = vec3(color.xy, sgn(color.z) * sqrt(1.0 - dot(color.xy, color.xy)));
-	float transmittance = abs(color.z);
-	// transmittance = abs(color.z) - 0.5;
-	float light = color.w;
+	vec3 ray;
+	float transmittance;
+	float light;
+	if (oct48) {
+		vec3 et = sample_oct(coord);
+		ray = oct_decode(et.xy);
+		transmittance = et.z;
+		light = texture(screen_light, coord).x;
+	} else {
+		vec4 color = texture(screen, coord);
+		ray = vec3(color.xy, sgn(color.z) * sqrt(1.0 - dot(color.xy, color.xy)));
+		transmittance = abs(color.z);
+		// transmittance = abs(color.z) - 0.5;
+		light = color.w;
+	}
 	vec3 ambient = vec3(0.05);
 	vec3 sky = texture(skybox, ray).rgb;
 	f_color = vec4(ambient + transmittance * sky + light_shift(light), 1.0);
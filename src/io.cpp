@@ -4,83 +4,213 @@
 
 
 using namespace std::chrono_literals;
-static constexpr size_t io_concurrency = 1u;
 static io_uring uring;
 static int fd;
+// O_DIRECT wants block aligned buffers, offsets and sizes
+static constexpr size_t direct_alignment = 4096;
+static bool direct;
+static off_t file_size;
+// index 0 of the registered files when set
+static bool fixed_file;
+static char *fixed_buf;
+static size_t fixed_size;
 
-void io_init()
+// one entry per request that was submitted but whose
+// completion has not been claimed yet, free when no_token
+struct io_slot
 {
-	int status = io_uring_queue_init(io_concurrency, &uring, 0);
+	io_token token;
+	int expected;
+	io_result result;
+};
+static std::unique_ptr<io_slot[]> slots;
+static unsigned slot_count;
+static io_token next_token;
+
+void io_init(unsigned queue_depth)
+{
+	assert(queue_depth > 0);
+	int status = io_uring_queue_init(queue_depth, &uring, 0);
 	if (status < 0) {
 		std::fprintf(stderr, "failed to setup uring\n");
 		std::exit(1);
 	}
 	fd = 0;
+	slots = std::make_unique<io_slot[]>(queue_depth);
+	slot_count = queue_depth;
+	for (unsigned i = 0; i < slot_count; ++i) {
+		slots[i].token = io_no_token;
+	}
+	next_token = io_no_token + 1;
 }
 
 void io_fini()
 {
 	io_uring_queue_exit(&uring);
+	slots.reset();
+}
+
+static io_slot *find_slot(io_token token)
+{
+	for (unsigned i = 0; i < slot_count; ++i) {
+		if (slots[i].token == token) {
+			return &slots[i];
+		}
+	}
+	return nullptr;
+}
+
+static size_t align_up(size_t x, size_t alignment)
+{
+	return (x + alignment - 1) / alignment * alignment;
 }
 
-bool issue_io_request(io_work_type type, void *buf, size_t size, off_t addr)
+io_token issue_io_request(io_work_type type, void *buf, size_t size, off_t addr)
 {
 	assert(size < std::numeric_limits<int>::max());
+	auto slot = find_slot(io_no_token);
+	if (!slot) {
+		return io_no_token;
+	}
 	auto sqe = io_uring_get_sqe(&uring);
-	int status = 0;
+	if (!sqe) {
+		return io_no_token;
+	}
+	char *at = (char*) buf;
+	int expected = (int) size;
+	if (direct && type == io_work_type::read) {
+		// widen to whole blocks, the caller left room
+		// for the lead-in before buf (see io_read_lead)
+		const off_t lead = addr % direct_alignment;
+		at -= lead;
+		addr -= lead;
+		size = align_up(lead + size, direct_alignment);
+		assert((std::uintptr_t) at % direct_alignment == 0);
+		// the last block stops short at the end of the file
+		expected = (int) std::max<off_t>(lead + expected,
+			std::min<off_t>(size, file_size - addr));
+	}
+	const int file = fixed_file? 0: fd;
+	const bool fixed = fixed_buf && at >= fixed_buf && at + size <= fixed_buf + fixed_size;
 	switch (type) {
 	case io_work_type::read:
-		io_uring_prep_read(sqe, fd, buf, size, addr);
-		sqe->user_data = size;
-		status = io_uring_submit(&uring);
+		if (fixed) {
+			io_uring_prep_read_fixed(sqe, file, at, size, addr, 0);
+		} else {
+			io_uring_prep_read(sqe, file, at, size, addr);
+		}
 		break;
 	case io_work_type::write:
-		io_uring_prep_write(sqe, fd, buf, size, addr);
-		sqe->user_data = size;
-		status = io_uring_submit(&uring);
+		if (fixed) {
+			io_uring_prep_write_fixed(sqe, file, at, size, addr, 0);
+		} else {
+			io_uring_prep_write(sqe, file, at, size, addr);
+		}
 		break;
 	}
+	if (fixed_file) {
+		sqe->flags |= IOSQE_FIXED_FILE;
+	}
+	const io_token token = next_token++;
+	sqe->user_data = token;
+	int status = io_uring_submit(&uring);
 	if (status < 0) {
 		std::fprintf(stderr, "[I/O error] %m\n");
+		return io_no_token;
 	}
-	return status >= 0;
+	slot->token = token;
+	slot->expected = expected;
+	slot->result = io_result::pending;
+	return token;
 }
 
-void blocking_open_read(const char *path)
+bool io_register_buffer(void *buf, size_t size)
+{
+	assert(!fixed_buf);
+	iovec iov{buf, size};
+	// this pins the pages once instead of on every request,
+	// it fails for memory the kernel can't pin like some mappings
+	if (io_uring_register_buffers(&uring, &iov, 1) != 0) {
+		return false;
+	}
+	fixed_buf = (char*) buf;
+	fixed_size = size;
+	return true;
+}
+
+void io_unregister_buffer()
+{
+	if (fixed_buf) {
+		io_uring_unregister_buffers(&uring);
+		fixed_buf = nullptr;
+	}
+}
+
+size_t io_read_alignment()
+{
+	return direct? direct_alignment: 1;
+}
+
+size_t io_read_lead(off_t addr)
+{
+	return direct? addr % direct_alignment: 0;
+}
+
+static void opened()
 {
-	assert(!fd);
-	fd = open(path, O_RDONLY);
 	assert(fd > 0);
+	struct stat st;
+	fstat(fd, &st);
+	file_size = st.st_size;
+	fixed_file = io_uring_register_files(&uring, &fd, 1) == 0;
+}
+
+void blocking_open_read(const char *path, bool direct_io)
+{
+	assert(!fd);
+	direct = false;
+	if (direct_io) {
+		fd = open(path, O_RDONLY|O_DIRECT);
+		direct = fd > 0;
+		if (!direct) {
+			std::fprintf(stderr, "[I/O] no O_DIRECT for %s, reading through the page cache\n", path);
+		}
+	}
+	if (!direct) {
+		fd = open(path, O_RDONLY);
+	}
+	opened();
 }
 
 void blocking_open_trunc(const char *path)
 {
 	assert(!fd);
 	fd = open(path, O_WRONLY|O_TRUNC|O_CREAT, S_IRUSR|S_IWUSR);
-	assert(fd > 0);
+	direct = false;
+	opened();
 }
 
 void blocking_open_recover(const char *path)
 {
 	assert(!fd);
 	fd = open(path, O_RDWR);
-	assert(fd > 0);
+	direct = false;
+	opened();
 }
 
 void blocking_close()
 {
 	assert(fd > 0);
+	if (fixed_file) {
+		io_uring_unregister_files(&uring);
+		fixed_file = false;
+	}
 	close(fd);
 #ifndef NDEBUG
 	fd = 0;
 #endif
 }
 
-bool io_completed(io_uring_cqe **pcqe)
-{
-	return io_uring_peek_cqe(&uring, pcqe) == 0;
-}
-
 static __kernel_timespec duration2timespec(time_interval ti)
 {
 	__kernel_timespec ts;
@@ -89,28 +219,100 @@ static __kernel_timespec duration2timespec(time_interval ti)
 	return ts;
 }
 
-bool try_complete_io_request(time_interval timeout)
+static io_slot *reap_one(instant_t deadline)
 {
 	io_uring_cqe *cqe;
-	auto ts = duration2timespec(timeout);
-	int status = io_uring_wait_cqe_timeout(&uring, &cqe, &ts);
-	int expected = 0;
-	if (status == 0) {
-		status = cqe->res;
-		expected = (int) cqe->user_data;
-		io_uring_cqe_seen(&uring, cqe);
-		assert(status == expected);
+	int status;
+	if (deadline == instant_t::max()) {
+		status = io_uring_wait_cqe(&uring, &cqe);
+	} else {
+		auto ts = duration2timespec(std::max(deadline - clk::now(), time_interval::zero()));
+		status = io_uring_wait_cqe_timeout(&uring, &cqe, &ts);
+	}
+	if (status != 0) {
+		return nullptr;
 	}
-	return status == expected;
+	auto slot = find_slot(cqe->user_data);
+	assert(slot);
+	const int res = cqe->res;
+	io_uring_cqe_seen(&uring, cqe);
+	if (res == slot->expected) {
+		slot->result = io_result::done;
+	} else {
+		if (res < 0) {
+			std::fprintf(stderr, "[I/O error] request %llu: %s\n",
+				(unsigned long long) slot->token, std::strerror(-res));
+		} else {
+			std::fprintf(stderr, "[I/O error] request %llu: short transfer %d/%d\n",
+				(unsigned long long) slot->token, res, slot->expected);
+		}
+		slot->result = io_result::failed;
+	}
+	return slot;
+}
+
+static io_result claim(io_slot *slot)
+{
+	const auto result = slot->result;
+	slot->token = io_no_token;
+	return result;
 }
 
-bool try_complete_io_request(instant_t deadline)
+io_result try_complete_io_request(io_token token, instant_t deadline)
 {
-	return try_complete_io_request(deadline - clk::now());
+	auto slot = find_slot(token);
+	assert(token != io_no_token && slot);
+	while (slot->result == io_result::pending) {
+		if (!reap_one(deadline)) {
+			return io_result::pending;
+		}
+	}
+	return claim(slot);
 }
 
-void complete_io_request()
+static instant_t timeout2deadline(time_interval timeout)
 {
-	try_complete_io_request(instant_t::max());
+	const auto now = clk::now();
+	if (timeout >= instant_t::max() - now) {
+		return instant_t::max();
+	}
+	return now + timeout;
 }
 
+io_result try_complete_io_request(io_token token, time_interval timeout)
+{
+	return try_complete_io_request(token, timeout2deadline(timeout));
+}
+
+io_result complete_io_request(io_token token)
+{
+	return try_complete_io_request(token, instant_t::max());
+}
+
+io_token try_complete_any_io_request(time_interval timeout, io_result *result)
+{
+	io_slot *slot = nullptr;
+	for (unsigned i = 0; i < slot_count && !slot; ++i) {
+		if (slots[i].token != io_no_token && slots[i].result != io_result::pending) {
+			slot = &slots[i];
+		}
+	}
+	if (!slot) {
+		slot = reap_one(timeout2deadline(timeout));
+	}
+	if (!slot) {
+		return io_no_token;
+	}
+	const io_token token = slot->token;
+	*result = claim(slot);
+	return token;
+}
+
+void complete_all_io_requests()
+{
+	for (unsigned i = 0; i < slot_count; ++i) {
+		if (slots[i].token != io_no_token) {
+			complete_io_request(slots[i].token);
+		}
+	}
+}
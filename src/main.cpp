@@ -9,6 +9,9 @@
 #include "timing.hpp"
 #include "io.hpp"
 #include "parse.hpp"
+#include "codec.hpp"
+#include "cpu_trace.hpp"
+#include "spsc_queue.hpp"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb/stb_image.h"
 
@@ -16,7 +19,12 @@ using namespace std::chrono_literals;
 
 static constexpr GLuint compute_local_dim = 8;
 static constexpr size_t chunk_frame_count = 16;
-static constexpr size_t host_pixel_size = 4 * 16 /* bits */ / 8 /* bits per byte */;
+static constexpr GLuint lut_width = 1024;
+static constexpr GLuint lut_height = 256;
+static constexpr size_t scene_state_size = 10*sizeof(float[4]);
+static constexpr unsigned io_queue_depth = 8;
+// GPU time per tile dispatch, well short of driver watchdogs
+static constexpr std::chrono::milliseconds dispatch_target{100};
 
 static const float quad[] = {
 	-1.0f, -1.0f, 0.0f, 1.0f,
@@ -44,118 +52,198 @@ GLuint describe_va()
 	return va;
 }
 
-static float smoothstep(float x)
-{
-	// flat tangents at 0 & 1, mapping [0,1] to [0,1]
-	return 3.0f * x * x - 2.0f * x * x * x;
-}
-
 struct file_header_t {
 	std::uint16_t width;
-	std::uint16_t tex_id;
+	std::uint8_t tex_id;
+	// older files have 0 here as the high byte of tex_id
+	std::uint8_t pixel_format;
 	std::uint32_t height;
 	std::uint32_t frame_count;
 	std::uint32_t ms_per_frame;
 	float rexp;
 	float gexp;
 	float bexp;
-	std::uint32_t __padding;
+	// "hol" and the version, files from before that left
+	// this uninitialized and are raw chunks back to back
+	char magic[3];
+	std::uint8_t version;
+};
+
+// values of win.pixel_format (PIXEL_* in shared_data.glsl)
+enum pixel_format : std::uint8_t {
+	pixel_rgba16,
+	pixel_oct48,
+	pixel_format_count,
+};
+
+// a chunk is one texture array per plane, and on the
+// host the planes of a chunk are one after the other
+struct pixel_plane
+{
+	GLenum internal_format;
+	GLenum format;
+	GLenum type;
+	size_t size;
+	// how many of the components of pack_ray() it holds
+	size_t components;
+	// where it is traced to, and the texture unit it is drawn from
+	GLuint image;
+	GLuint unit;
+};
+
+static constexpr size_t max_planes = 2;
+static constexpr pixel_plane rgba16_planes[] = {
+	// half floats on the host are what older files have
+	{ GL_RGBA16_SNORM, GL_RGBA, GL_HALF_FLOAT, 4 * sizeof(std::uint16_t), 4, 0, 0 },
+};
+// the ray and transmittance packed by oct_pack() in compute.glsl, integer
+// textures aren't filtered so the fragment shader does that itself
+static constexpr pixel_plane oct48_planes[] = {
+	{ GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, sizeof(std::uint32_t), 3, 2, 1 },
+	{ GL_R16, GL_RED, GL_UNSIGNED_SHORT, sizeof(std::uint16_t), 1, 3, 5 },
+};
+
+std::span<const pixel_plane> pixel_planes(std::uint8_t format)
+{
+	if (format == pixel_oct48) {
+		return oct48_planes;
+	}
+	return rgba16_planes;
+}
+
+size_t host_pixel_size(std::uint8_t format)
+{
+	size_t size = 0;
+	for (const auto &plane: pixel_planes(format)) {
+		size += plane.size;
+	}
+	return size;
+}
+
+codec_layout chunk_layout(std::uint8_t format, size_t chunk_pixels)
+{
+	if (format == pixel_oct48) {
+		// both halves of the packed ray, then light
+		return codec_layout{3, {0, 1, 2 * chunk_pixels}, {2, 2, 1}};
+	}
+	return interleaved_layout(4);
+}
+
+struct sim_chunk
+{
+	GLuint plane[max_planes];
 };
 
-static GLsync transfer_fence;
+static constexpr char sim_magic[3] = { 'h', 'o', 'l' };
+static constexpr std::uint8_t sim_version_packed = 1;
+
+// packed files follow the header with the end offset of every
+// chunk, which stays 0 until the chunk is on disk, and then
+// the chunks each encoded on their own (see codec.hpp)
+struct chunk_index
+{
+	bool packed;
+	size_t raw_size;
+	off_t data_start;
+	std::unique_ptr<std::uint64_t[]> end;
 
-void complete_dump()
+	off_t start(size_t i) const
+	{
+		if (!packed) {
+			return data_start + i * raw_size;
+		}
+		return i? end[i-1]: data_start;
+	}
+
+	size_t size(size_t i) const
+	{
+		return packed? end[i] - start(i): raw_size;
+	}
+};
+
+chunk_index make_chunk_index(const file_header_t &header, bool packed)
 {
-	complete_io_request();
+	chunk_index chunks;
+	const size_t n_chunks = header.frame_count / chunk_frame_count;
+	chunks.packed = packed;
+	chunks.raw_size = header.width * header.height * chunk_frame_count * host_pixel_size(header.pixel_format);
+	chunks.data_start = sizeof header;
+	if (packed) {
+		chunks.data_start += n_chunks * sizeof(std::uint64_t);
+		chunks.end = std::make_unique<std::uint64_t[]>(n_chunks);
+	}
+	return chunks;
 }
 
-void issue_dump(size_t size, GLuint chunk_name, off_t addr, void *buf)
+bool is_packed(const file_header_t &header)
 {
-	// this blocks until packing is done, ideally we would stream the texture using DSA
-	glGetTextureImage(chunk_name, 0, GL_RGBA, GL_HALF_FLOAT, size, buf);
-	issue_io_request(io_work_type::write, buf, size, addr);
+	return std::memcmp(header.magic, sim_magic, sizeof sim_magic) == 0
+		&& header.version == sim_version_packed;
 }
 
-bool issue_load(void *buf, size_t size, off_t addr)
+void issue_pack(std::uint8_t format, const sim_chunk &chunk, GLuint width, GLuint height,
+	GLintptr device_addr, GLsync *fence)
+{
+	// NOTE: a pixel pack buffer is bound so this is asynchronous
+	glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+	const auto planes = pixel_planes(format);
+	for (size_t p = 0; p < planes.size(); ++p) {
+		const size_t size = width * height * chunk_frame_count * planes[p].size;
+		glGetTextureImage(chunk.plane[p], 0, planes[p].format, planes[p].type, size, (void*) device_addr);
+		device_addr += size;
+	}
+	*fence = fence_insert(*fence);
+}
+
+io_token issue_dump(size_t size, off_t addr, void *buf)
+{
+	const auto token = issue_io_request(io_work_type::write, buf, size, addr);
+	assert(token != io_no_token);
+	return token;
+}
+
+io_token issue_load(void *buf, size_t size, off_t addr)
 {
 	return issue_io_request(io_work_type::read, buf, size, addr);
 }
 
 void blocking_load(void *buf, size_t size, off_t addr)
 {
-	issue_load(buf, size, addr);
-	complete_io_request();
+	const auto token = issue_load(buf, size, addr);
+	assert(token != io_no_token);
+	complete_io_request(token);
 }
 
-void pixel_unpack(GLuint name, GLuint width, GLuint height, GLintptr device_addr, instant_t deadline = instant_t::max())
+void pixel_unpack(std::uint8_t format, const sim_chunk &chunk, GLuint width, GLuint height,
+	GLintptr device_addr, GLsync *fence)
 {
 	// NOTE: a pixel buffer is bound so this is asynchronous
-	glTextureSubImage3D(name, 0, 0, 0, 0, width, height, chunk_frame_count,
-		GL_RGBA, GL_HALF_FLOAT, (void*) device_addr);
-	// transfer_fence = fence_insert(transfer_fence);
-	glDeleteSync(transfer_fence);
-	// FIXME: this call randomly takes up 40ms and blows frametimes
-	transfer_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
-}
-
-// we can't unpack to texture[i+2] while
-// we are drawing texture[i], so instead
-// texture[i] finishes whatever the data
-// pipeline is for i+1 and then begins
-// loading for the i+2 pipeline.
-// so chunk_name, device_addr and
-// transfer_fence refer to the current
-// buffer's next, and the io_request
-// refer to the current buffer's next's next.
-// when the time comes to draw i+1,
-// this `pipeline` gets reset so it
-// must be flushed prior.
-static constexpr int try_stream_load_reset = 4;
-static constexpr int try_stream_load_nop = 0;
-int try_stream_load(io_request req, GLuint width, GLuint height,
-	GLintptr device_addr, GLuint chunk_name, int suspend, instant_t deadline)
-{
-	// coroutine lol
-	switch (suspend) {
-	case 4:
-		pixel_unpack(chunk_name, width, height, device_addr, deadline);
-		/* fallthrough */
-	case 3:
-		if (!fence_try_wait(transfer_fence, deadline)) {
-			return 3;
-		}
-		/* fallthrough */
-	case 2:
-		if (!issue_load(req.buf, req.size, req.addr)) {
-			return 2;
-		}
-		/* fallthrough */
-	case 1:
-		if (!try_complete_io_request(deadline)) {
-			return 1;
-		}
-		/* fallthrough */
-	case 0:
-		return 0;
-	default:
-		assert(false && "oob suspend value");
+	const auto planes = pixel_planes(format);
+	for (size_t p = 0; p < planes.size(); ++p) {
+		glTextureSubImage3D(chunk.plane[p], 0, 0, 0, 0, width, height, chunk_frame_count,
+			planes[p].format, planes[p].type, (void*) device_addr);
+		device_addr += width * height * chunk_frame_count * planes[p].size;
 	}
+	// FIXME: this call randomly takes up 40ms and blows frametimes
+	*fence = fence_insert(*fence);
+	glFlush();
 }
 
-void draw_quad(GLuint shader, GLuint quad_va, float frame, float select)
+void draw_quad(GLuint shader, GLuint quad_va, float frame)
 {
 	glUseProgram(shader);
 	glUniform1f(2, frame);
-	glUniform1f(3, select);
 	glBindVertexArray(quad_va);
 	glDrawArrays(GL_TRIANGLES, 0, 6);
 }
 
 enum texture_settings {
 	use_mipmaps = 1 << 0,
+	// all levels were uploaded, don't generate them
+	mipmaps_loaded = 1 << 1,
 };
 
-void sensible_texture_defaults(GLenum kind, texture_settings ts = texture_settings(0))
+void sensible_texture_defaults(GLenum kind, int ts = 0)
 {
 	glTexParameteri(kind, GL_TEXTURE_MIN_FILTER,
 		(ts & texture_settings::use_mipmaps)? GL_LINEAR_MIPMAP_LINEAR: GL_LINEAR);
@@ -163,36 +251,177 @@ void sensible_texture_defaults(GLenum kind, texture_settings ts = texture_settin
 	glTexParameteri(kind, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(kind, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glTexParameteri(kind, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-	if (ts & texture_settings::use_mipmaps) {
+	if ((ts & texture_settings::use_mipmaps) && !(ts & texture_settings::mipmaps_loaded)) {
 		glGenerateMipmap(kind);
 	}
 }
 
+static constexpr const char *cubemap_faces[6] = { "px", "nx", "py", "ny", "pz", "nz" };
+
+// the faces decoded and with their mipmaps, level by level from +x to
+// -z, cached next to the pngs so that later runs only have to map them
+struct cubemap_header
+{
+	// "cub" and the version
+	char magic[3];
+	std::uint8_t version;
+	std::uint32_t size;
+	std::uint32_t levels;
+};
+static constexpr char cubemap_magic[3] = { 'c', 'u', 'b' };
+static constexpr std::uint8_t cubemap_version = 1;
+
+static size_t cubemap_level_size(size_t size, size_t level)
+{
+	const size_t side = std::max<size_t>(1, size >> level);
+	return side * side * 4 /* RGBA8 */;
+}
+
+// false if the cache is missing, damaged or older than one of the pngs
+static bool load_cubemap_cache(const char *cache_path, const char (*face_paths)[128])
+{
+	const int fd = open(cache_path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	fstat(fd, &st);
+	for (size_t face = 0; face < std::size(cubemap_faces); ++face) {
+		struct stat png;
+		if (stat(face_paths[face], &png) == 0 && png.st_mtime >= st.st_mtime) {
+			close(fd);
+			return false;
+		}
+	}
+	const size_t file_size = st.st_size;
+	void *map = file_size >= sizeof(cubemap_header)
+		? mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (map == MAP_FAILED) {
+		return false;
+	}
+	cubemap_header header;
+	std::memcpy(&header, map, sizeof header);
+	size_t expected = sizeof header;
+	const bool valid = !std::memcmp(header.magic, cubemap_magic, sizeof cubemap_magic)
+		&& header.version == cubemap_version && header.size > 0
+		&& header.levels > 0 && header.levels <= std::bit_width(header.size);
+	if (valid) {
+		for (size_t level = 0; level < header.levels; ++level) {
+			expected += std::size(cubemap_faces) * cubemap_level_size(header.size, level);
+		}
+	}
+	if (!valid || expected != file_size) {
+		munmap(map, file_size);
+		return false;
+	}
+
+	glTexStorage2D(GL_TEXTURE_CUBE_MAP, header.levels, GL_RGBA8, header.size, header.size);
+	const char *at = (const char *) map + sizeof header;
+	for (GLint level = 0; level < GLint(header.levels); ++level) {
+		const GLsizei side = std::max<GLsizei>(1, header.size >> level);
+		for (size_t face = 0; face < std::size(cubemap_faces); ++face) {
+			glTexSubImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, level, 0, 0, side, side,
+				GL_RGBA, GL_UNSIGNED_BYTE, at);
+			at += cubemap_level_size(header.size, level);
+		}
+	}
+	munmap(map, file_size);
+	return true;
+}
+
+// reads back what the driver made of the faces and their mipmaps
+static void store_cubemap_cache(const char *cache_path, GLuint size, GLuint levels)
+{
+	size_t total = 0;
+	for (size_t level = 0; level < levels; ++level) {
+		total += std::size(cubemap_faces) * cubemap_level_size(size, level);
+	}
+	auto data = std::make_unique<char[]>(total);
+	char *at = data.get();
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	for (GLint level = 0; level < GLint(levels); ++level) {
+		for (size_t face = 0; face < std::size(cubemap_faces); ++face) {
+			glGetTexImage(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, level, GL_RGBA, GL_UNSIGNED_BYTE, at);
+			at += cubemap_level_size(size, level);
+		}
+	}
+	cubemap_header header;
+	std::memcpy(header.magic, cubemap_magic, sizeof cubemap_magic);
+	header.version = cubemap_version;
+	header.size = size;
+	header.levels = levels;
+	// written aside first so that another run never maps half of it
+	char tmp_path[160];
+	std::snprintf(tmp_path, sizeof tmp_path, "%s.tmp", cache_path);
+	{
+		std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+		file.write((const char *) &header, sizeof header);
+		file.write(data.get(), total);
+		if (!file) {
+			std::fprintf(stderr, "[skybox] could not write %s\n", tmp_path);
+			return;
+		}
+	}
+	std::rename(tmp_path, cache_path);
+}
+
 GLuint load_skybox(GLenum unit, const char *path_fmt)
 {
 	GLuint tex;
 	glGenTextures(1, &tex);
 	glActiveTexture(unit);
 	glBindTexture(GL_TEXTURE_CUBE_MAP, tex);
-	const char *replacement[6] = { "px", "nx", "py", "ny", "pz", "nz" };
 	static constexpr size_t bufsize = 128;
-	char buf[bufsize];
-	for (size_t face = 0; face < std::size(replacement); ++face) {
-		int width;
-		int height;
-		int channels;
-		std::snprintf(buf, bufsize, path_fmt, replacement[face]);
-		auto data = stbi_load(buf, &width, &height, &channels, 4);
-		assert(data);
-		glTexImage2D(
-			GL_TEXTURE_CUBE_MAP_POSITIVE_X + face,
-			0 /* mipmap */, GL_RGBA,
-			width, height,
-			0, GL_RGBA, GL_UNSIGNED_BYTE, data
-		);
-		stbi_image_free(data);
-	}
-	sensible_texture_defaults(GL_TEXTURE_CUBE_MAP, texture_settings::use_mipmaps);
+	char face_paths[std::size(cubemap_faces)][bufsize];
+	for (size_t face = 0; face < std::size(cubemap_faces); ++face) {
+		std::snprintf(face_paths[face], bufsize, path_fmt, cubemap_faces[face]);
+	}
+	const char *dir_end = std::strrchr(path_fmt, '/');
+	char cache_path[bufsize];
+	std::snprintf(cache_path, bufsize, "%.*s/cubemap.bin", dir_end ? int(dir_end - path_fmt) : 1,
+		dir_end ? path_fmt : ".");
+	if (load_cubemap_cache(cache_path, face_paths)) {
+		sensible_texture_defaults(GL_TEXTURE_CUBE_MAP, use_mipmaps | mipmaps_loaded);
+		return tex;
+	}
+
+	// inflating the pngs is most of the work, so the faces go in parallel
+	stbi_uc *data[std::size(cubemap_faces)];
+	int width[std::size(cubemap_faces)];
+	int height[std::size(cubemap_faces)];
+	// stb keeps why it failed per thread
+	const char *failure[std::size(cubemap_faces)];
+	std::thread decoders[std::size(cubemap_faces)];
+	for (size_t face = 0; face < std::size(cubemap_faces); ++face) {
+		decoders[face] = std::thread{[&, face] {
+			int channels;
+			data[face] = stbi_load(face_paths[face], &width[face], &height[face], &channels, 4);
+			failure[face] = data[face] ? nullptr : stbi_failure_reason();
+		}};
+	}
+	for (auto &decoder: decoders) {
+		decoder.join();
+	}
+	// the sizes are only set for the faces that were decoded
+	for (size_t face = 0; face < std::size(cubemap_faces); ++face) {
+		if (!data[face]) {
+			std::fprintf(stderr, "[skybox] could not load %s: %s\n", face_paths[face],
+				failure[face] ? failure[face] : "unknown error");
+			std::exit(1);
+		}
+	}
+	const GLuint size = width[0];
+	const GLuint levels = std::bit_width(size);
+	glTexStorage2D(GL_TEXTURE_CUBE_MAP, levels, GL_RGBA8, size, size);
+	for (size_t face = 0; face < std::size(cubemap_faces); ++face) {
+		assert(GLuint(width[face]) == size && GLuint(height[face]) == size);
+		glTexSubImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, 0, 0, size, size,
+			GL_RGBA, GL_UNSIGNED_BYTE, data[face]);
+		stbi_image_free(data[face]);
+	}
+	sensible_texture_defaults(GL_TEXTURE_CUBE_MAP, use_mipmaps);
+	store_cubemap_cache(cache_path, size, levels);
 	return tex;
 }
 
@@ -204,58 +433,732 @@ GLuint texture_array(GLenum unit, GLenum format, size_t width, size_t height, si
 	glBindTexture(GL_TEXTURE_2D_ARRAY, tex);
 	glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1 /* mipmap */, format, width, height, depth);
 	sensible_texture_defaults(GL_TEXTURE_2D_ARRAY);
+	if (format == GL_R32UI) {
+		// integer textures are incomplete with linear filtering
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	}
 	return tex;
 }
 
-void enable_sim_frame(GLuint binding, GLuint texture, size_t index, GLenum format)
+sim_chunk chunk_textures(std::uint8_t format, size_t width, size_t height)
+{
+	sim_chunk chunk{};
+	const auto planes = pixel_planes(format);
+	for (size_t p = 0; p < planes.size(); ++p) {
+		chunk.plane[p] = texture_array(GL_TEXTURE0 + planes[p].unit,
+			planes[p].internal_format, width, height, chunk_frame_count);
+	}
+	return chunk;
+}
+
+// the chunk that is drawn from
+void bind_sim_chunk(std::uint8_t format, const sim_chunk &chunk)
+{
+	const auto planes = pixel_planes(format);
+	for (size_t p = 0; p < planes.size(); ++p) {
+		glBindTextureUnit(planes[p].unit, chunk.plane[p]);
+	}
+}
+
+// what oct_pack() in compute.glsl does with them
+std::uint32_t oct_pack(float x, float y, float transmittance)
+{
+	const auto quantize = [](float v, float lo, float scale, float offset) {
+		return std::uint32_t(std::floor(std::clamp(v, lo, 1.0f) * scale + offset));
+	};
+	const std::uint32_t qx = quantize(x, -1.0f, 2047.0f, 2048.5f);
+	const std::uint32_t qy = quantize(y, -1.0f, 2047.0f, 2048.5f);
+	const std::uint32_t t = quantize(transmittance, 0.0f, 255.0f, 0.5f);
+	return qx << 20 | (t >> 4) << 16 | qy << 4 | (t & 15);
+}
+
+// the planes take the components of pack_ray() in order,
+// scratch holds two of them for every pixel of the chunk
+void upload_chunk(std::uint8_t format, const sim_chunk &chunk, GLuint width, GLuint height,
+	const float *pixels, float *scratch)
+{
+	const size_t n_pixels = size_t(width) * height * chunk_frame_count;
+	const auto planes = pixel_planes(format);
+	size_t first = 0;
+	for (size_t p = 0; p < planes.size(); ++p) {
+		const size_t components = planes[p].components;
+		const float *data = pixels;
+		if (planes[p].format == GL_RED_INTEGER) {
+			for (size_t i = 0; i < n_pixels; ++i) {
+				const float *c = pixels + 4 * i + first;
+				const std::uint32_t word = oct_pack(c[0], c[1], c[2]);
+				std::memcpy(scratch + i, &word, sizeof word);
+			}
+			glTextureSubImage3D(chunk.plane[p], 0, 0, 0, 0, width, height, chunk_frame_count,
+				GL_RED_INTEGER, GL_UNSIGNED_INT, scratch);
+			first += components;
+			continue;
+		}
+		if (components != 4) {
+			for (size_t i = 0; i < n_pixels; ++i) {
+				for (size_t c = 0; c < components; ++c) {
+					scratch[i * components + c] = pixels[4 * i + first + c];
+				}
+			}
+			data = scratch;
+		}
+		glTextureSubImage3D(chunk.plane[p], 0, 0, 0, 0, width, height, chunk_frame_count,
+			planes[p].format, GL_FLOAT, data);
+		first += components;
+	}
+}
+
+void enable_sim_chunk(std::uint8_t format, const sim_chunk &chunk)
 {
-	glBindImageTexture(binding, texture, 0, GL_FALSE, index, GL_WRITE_ONLY, format);
+	const auto planes = pixel_planes(format);
+	// reprojected frames load what the first frame of the chunk
+	// traced and the fill pass loads the coarse grid, both of which
+	// are undefined through a write-only binding
+	for (size_t p = 0; p < planes.size(); ++p) {
+		glBindImageTexture(planes[p].image, chunk.plane[p], 0, GL_TRUE, 0,
+			GL_READ_WRITE, planes[p].internal_format);
+	}
 }
 
-GLuint back_and_forth(GLuint index_, GLuint max_value_)
+// where playback is and where it goes from there, one tick per
+// frame_time: the clip is played back and forth or forward in a loop,
+// `speed` frames a tick and backwards while it is negative
+struct play_order
+{
+	GLuint n_frames;
+	bool loop;
+	double frame;
+	double speed;
+
+	GLuint current() const
+	{
+		return GLuint(frame);
+	}
+
+	GLuint chunk() const
+	{
+		return current() / chunk_frame_count;
+	}
+
+	// wraps around in a loop and stops at the ends otherwise
+	void seek(double to)
+	{
+		if (loop) {
+			frame = to - std::floor(to / n_frames) * n_frames;
+			// rounding can land right on n_frames
+			frame = std::min(frame, std::nextafter(double(n_frames), 0.0));
+		} else {
+			frame = std::clamp(to, 0.0, double(n_frames - 1));
+		}
+	}
+
+	void tick()
+	{
+		if (loop) {
+			seek(frame + speed);
+			return;
+		}
+		frame += speed;
+		// bounces off the first and the last frame
+		const double last = n_frames - 1;
+		while (frame < 0.0 || frame > last) {
+			frame = frame < 0.0 ? -frame : 2.0*last - frame;
+			speed = -speed;
+		}
+	}
+
+	// the chunks it shows next in the order they are first shown, the
+	// current one first, as many as there are up to `count`
+	size_t upcoming(GLuint *chunks, size_t count) const
+	{
+		size_t n = 0;
+		chunks[n++] = chunk();
+		if (speed == 0.0) {
+			return n;
+		}
+		// every frame comes back within a round trip
+		const double ticks = 2.0 * n_frames / std::abs(speed) + 1.0;
+		play_order next = *this;
+		for (double t = 0.0; t < ticks && n < count; ++t) {
+			next.tick();
+			const GLuint c = next.chunk();
+			if (std::find(chunks, chunks + n, c) == chunks + n) {
+				chunks[n++] = c;
+			}
+		}
+		return n;
+	}
+};
+
+// the chunks around the one being drawn. Every slot has its textures and
+// its part of the streaming buffer (and of the memory packed chunks are
+// read to), and holds the chunk it was last given until another chunk
+// needs the room, so that those played again after playback turns around
+// or seeks close by are not read again.
+// A reader thread owns the I/O: it gets the slots to fill once nothing
+// unpacks from them anymore, reads as many ahead as the I/O queue takes,
+// decodes them and hands them back, so the thread drawing only unpacks
+// them to their textures, one at a time
+struct playback_cache
+{
+	enum class slot_state
+	{
+		empty,
+		// waiting for the last unpack from it before it is read to
+		queued,
+		// the reader has it
+		loading,
+		// in its textures
+		ready,
+	};
+
+	struct slot
+	{
+		sim_chunk sim;
+		// its part of the streaming buffer, and where the pixels start
+		GLintptr base_addr;
+		GLintptr device_addr;
+		// where packed chunks are read to
+		char *packed;
+		io_request req;
+		// the last unpack from device_addr
+		GLsync fence;
+		GLuint chunk;
+		slot_state state;
+		// the chunk is to be drawn as soon as it is read
+		bool urgent;
+	};
+
+	// a slot for the reader, no_chunk stops it
+	struct load
+	{
+		GLuint slot;
+		bool urgent;
+	};
+	static constexpr GLuint no_chunk = -1;
+
+	std::uint8_t format;
+	GLuint width;
+	GLuint height;
+	const chunk_index &chunks;
+	char *streaming_memory;
+	chunk_decoder *decoder;
+	codec_layout layout;
+	size_t depth;
+	std::unique_ptr<slot[]> slots;
+	// the slots in the order they were queued, and the one drawn
+	GLuint order[max_playback_depth];
+	size_t n_queued;
+	size_t shown;
+	// slots to load and loaded slots
+	spsc_queue<load, max_playback_depth> requests;
+	spsc_queue<GLuint, max_playback_depth> loaded;
+	std::thread reader;
+
+	playback_cache(std::uint8_t format, GLuint width, GLuint height, const chunk_index &chunks,
+		size_t depth, char *streaming_memory, size_t streaming_base, size_t streaming_stride,
+		char *packed_memory, size_t packed_stride, chunk_decoder *decoder)
+		: format{format}, width{width}, height{height}, chunks{chunks},
+		streaming_memory{streaming_memory}, decoder{decoder},
+		layout{chunk_layout(format, size_t(width) * height * chunk_frame_count)},
+		depth{depth}, slots{std::make_unique<slot[]>(depth)},
+		n_queued{0}, shown{0}
+	{
+		assert(depth <= max_playback_depth);
+		for (size_t i = 0; i < depth; ++i) {
+			slots[i].sim = chunk_textures(format, width, height);
+			slots[i].base_addr = streaming_base + i * streaming_stride;
+			slots[i].packed = packed_memory ? packed_memory + i * packed_stride : nullptr;
+			slots[i].req.token = io_no_token;
+			slots[i].fence = nullptr;
+			slots[i].chunk = no_chunk;
+			slots[i].state = slot_state::empty;
+		}
+		reader = std::thread{&playback_cache::read_ahead, this};
+	}
+
+	~playback_cache()
+	{
+		const bool sent = requests.try_push(load{no_chunk, false});
+		assert(sent);
+		reader.join();
+		for (size_t i = 0; i < depth; ++i) {
+			glDeleteTextures(max_planes, slots[i].sim.plane);
+			glDeleteSync(slots[i].fence);
+		}
+	}
+
+	// reads the chunks that are needed next and are not there yet, most
+	// needed first, to the slots of those that are not needed or else of
+	// those furthest from the first one, so that the chunks just played
+	// stay around for as long as there is room. The first one goes
+	// before whatever the reader has if it has to be read
+	void plan(const GLuint *needed, size_t count)
+	{
+		assert(count <= depth);
+		auto is_needed = [&](GLuint chunk) {
+			return std::find(needed, needed + count, chunk) != needed + count;
+		};
+		// what is not handed to the reader yet goes by the new order
+		for (size_t i = 0; i < depth; ++i) {
+			if (slots[i].state == slot_state::queued) {
+				slots[i].chunk = no_chunk;
+				slots[i].state = slot_state::empty;
+			}
+		}
+		n_queued = 0;
+		auto victim = [&] {
+			size_t best = depth;
+			GLuint best_distance = 0;
+			for (size_t i = 0; i < depth; ++i) {
+				const slot &s = slots[i];
+				if (s.state == slot_state::empty) {
+					return i;
+				}
+				if (s.state != slot_state::ready || is_needed(s.chunk)) {
+					continue;
+				}
+				const GLuint distance = std::max(s.chunk, needed[0]) - std::min(s.chunk, needed[0]);
+				if (best == depth || distance > best_distance) {
+					best = i;
+					best_distance = distance;
+				}
+			}
+			return best;
+		};
+		for (size_t c = 0; c < count; ++c) {
+			if (find(needed[c])) {
+				continue;
+			}
+			size_t i = victim();
+			// the chunk to draw waits for the slots of the chunks
+			// no longer needed to be read to, the others come later
+			while (i == depth && c == 0) {
+				unpack(loaded.pop());
+				i = victim();
+			}
+			if (i == depth) {
+				break;
+			}
+			queue(i, needed[c], c == 0);
+		}
+	}
+
+	// hands the reader what slots it can and moves one loaded chunk
+	// along to its textures, false if the deadline came first
+	bool stream(instant_t deadline)
+	{
+		size_t handed = 0;
+		for (; handed < n_queued; ++handed) {
+			slot &s = slots[order[handed]];
+			if (s.fence && !fence_try_wait(s.fence, deadline)) {
+				break;
+			}
+			s.state = slot_state::loading;
+			const bool sent = requests.try_push(load{order[handed], s.urgent});
+			assert(sent);
+		}
+		std::copy(order + handed, order + n_queued, order);
+		n_queued -= handed;
+		GLuint i;
+		if (loaded.try_pop(i)) {
+			unpack(i);
+		}
+		return n_queued == 0;
+	}
+
+	// draws from the slot of `chunk` from now on, waits
+	// for it if it is not ready, plan() must have queued it
+	const slot &show(GLuint chunk)
+	{
+		slot *s = find(chunk);
+		assert(s);
+		while (s->state != slot_state::ready) {
+			stream(instant_t::max());
+			if (s->state == slot_state::loading) {
+				unpack(loaded.pop());
+			}
+		}
+		shown = s - slots.get();
+		return *s;
+	}
+
+	// waits until every slot is loaded
+	void settle()
+	{
+		while (n_queued || loading()) {
+			stream(instant_t::max());
+			if (loading()) {
+				unpack(loaded.pop());
+			}
+		}
+	}
+
+	const slot &current() const
+	{
+		return slots[shown];
+	}
+
+private:
+	slot *find(GLuint chunk)
+	{
+		for (size_t i = 0; i < depth; ++i) {
+			if (slots[i].chunk == chunk) {
+				return &slots[i];
+			}
+		}
+		return nullptr;
+	}
+
+	bool loading() const
+	{
+		for (size_t i = 0; i < depth; ++i) {
+			if (slots[i].state == slot_state::loading) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void queue(GLuint i, GLuint chunk, bool urgent)
+	{
+		slot &s = slots[i];
+		const off_t addr = chunks.start(chunk);
+		// direct reads land at the file offset modulo the block size
+		// past the start of where they go, the decoder writes at the start
+		s.device_addr = s.base_addr + (s.packed ? 0 : io_read_lead(addr));
+		char *buf = (s.packed ? s.packed : streaming_memory + s.base_addr) + io_read_lead(addr);
+		s.req = io_request{buf, chunks.size(chunk), addr, io_no_token};
+		s.chunk = chunk;
+		s.state = slot_state::queued;
+		s.urgent = urgent;
+		order[n_queued++] = i;
+	}
+
+	void unpack(GLuint i)
+	{
+		slot &s = slots[i];
+		assert(s.state == slot_state::loading);
+		pixel_unpack(format, s.sim, width, height, s.device_addr, &s.fence);
+		s.state = slot_state::ready;
+	}
+
+	// the slots are loaded in the order they are asked for, except that
+	// urgent ones are done before the reads in flight are
+	void read_ahead()
+	{
+		GLuint in_flight[max_playback_depth];
+		size_t n_in_flight = 0;
+		auto finish = [&](size_t k) {
+			const GLuint i = in_flight[k];
+			std::copy(in_flight + k + 1, in_flight + n_in_flight, in_flight + k);
+			--n_in_flight;
+			slot &s = slots[i];
+			complete_io_request(s.req.token);
+			s.req.token = io_no_token;
+			if (decoder) {
+				decoder->start(chunk_decoder::job{
+					(const std::uint8_t*) s.req.buf, s.req.size,
+					(std::uint16_t*) (streaming_memory + s.device_addr),
+					layout, size_t(width) * height, chunk_frame_count
+				});
+				decoder->finish();
+			}
+			const bool sent = loaded.try_push(i);
+			assert(sent);
+		};
+		for (;;) {
+			// only sleeps when there is nothing left to finish
+			load l;
+			if (!n_in_flight) {
+				l = requests.pop();
+			} else if (!requests.try_pop(l)) {
+				finish(0);
+				continue;
+			}
+			if (l.slot == no_chunk) {
+				break;
+			}
+			slot &s = slots[l.slot];
+			while ((s.req.token = issue_load(s.req.buf, s.req.size, s.req.addr)) == io_no_token) {
+				assert(n_in_flight && "the read could not be issued");
+				finish(0);
+			}
+			in_flight[n_in_flight++] = l.slot;
+			if (l.urgent) {
+				finish(n_in_flight - 1);
+			}
+		}
+		complete_all_io_requests();
+	}
+};
+
+// sizes the tiles (in work groups) from the GPU time that the
+// dispatches of the previous ones took, so that expensive frames get
+// small tiles and cheap ones get tiles large enough to fill the GPU.
+// Coarse grid and fill dispatches, reprojected or not, cost very
+// different amounts per work group, so each kind keeps its own estimate.
+// The timer queries are read back a few dispatches late to not stall
+struct tile_sizer
 {
-	int index = index_;
-	int max_value = max_value_;
-	return max_value - std::abs(index % (2 * max_value) - max_value);
+	static constexpr size_t n_queries = 4;
+	static constexpr size_t n_kinds = 4;
+	GLuint query[n_queries];
+	// the work groups of the dispatch each query times, and its kind
+	double timed[n_queries];
+	size_t timed_kind[n_queries];
+	size_t issued;
+	size_t harvested;
+	// GPU seconds per work group of each kind of dispatch
+	double cost[n_kinds];
+	GLuint max_width;
+	GLuint max_height;
+
+	tile_sizer(GLuint max_width, GLuint max_height)
+		: issued{0}, harvested{0}, max_width{max_width}, max_height{max_height}
+	{
+		glCreateQueries(GL_TIME_ELAPSED, n_queries, query);
+		// small enough to be safe in any frame, it grows from there
+		std::fill(std::begin(cost), std::end(cost), target() / (16 * 16 * chunk_frame_count));
+	}
+
+	~tile_sizer()
+	{
+		glDeleteQueries(n_queries, query);
+	}
+
+	static size_t kind(bool grid, bool reproject)
+	{
+		return 2 * grid + reproject;
+	}
+
+	static double target()
+	{
+		return std::chrono::duration<double>(dispatch_target).count();
+	}
+
+	// work groups per dispatch, all layers included
+	double volume(size_t kind) const
+	{
+		return std::max(1.0, target() / cost[kind]);
+	}
+
+	// for dispatches covering that many layers, rows are as tall as
+	// square tiles would be and their tiles as wide as fits the volume
+	GLuint height(size_t kind, GLuint layers) const
+	{
+		return std::clamp<GLuint>(GLuint(std::sqrt(volume(kind) / layers)), 1, max_height);
+	}
+
+	GLuint width(size_t kind, GLuint layers, GLuint height) const
+	{
+		return std::clamp<GLuint>(GLuint(volume(kind) / (double(layers) * height)), 1, max_width);
+	}
+
+	void begin(size_t kind, GLuint width, GLuint height, GLuint layers)
+	{
+		if (issued - harvested == n_queries) {
+			harvest(true);
+		}
+		const size_t i = issued % n_queries;
+		timed[i] = double(width) * height * layers;
+		timed_kind[i] = kind;
+		glBeginQuery(GL_TIME_ELAPSED, query[i]);
+	}
+
+	void end()
+	{
+		glEndQuery(GL_TIME_ELAPSED);
+		++issued;
+		while (harvested < issued && harvest(false)) {
+		}
+	}
+
+	// adapts to the oldest query in flight, false if it is not done
+	bool harvest(bool wait)
+	{
+		const size_t i = harvested % n_queries;
+		if (!wait) {
+			GLuint available;
+			glGetQueryObjectuiv(query[i], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available) {
+				return false;
+			}
+		}
+		GLuint64 elapsed;
+		glGetQueryObjectui64v(query[i], GL_QUERY_RESULT, &elapsed);
+		++harvested;
+		// the cost of a tile is about proportional to its volume, the
+		// next tiles of that kind are at most twice or half as large
+		const double seconds = std::chrono::duration<double>(time_interval(std::max<GLuint64>(elapsed, 1))).count();
+		cost[timed_kind[i]] = std::clamp(seconds / timed[i], 0.5 * target() / timed[i], 2.0 * target() / timed[i]);
+		return true;
+	}
+};
+
+// the deflection table is dimensionless, so it is built
+// once with the first frame that has a black hole
+void build_lut(GLuint shader, GLuint lut, gl_ssb &scene_state, size_t n_frames)
+{
+	GLuint scene = 0;
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	for (; scene < n_frames; ++scene) {
+		float rs;
+		scene_state.read(&rs, (1+scene)*scene_state_size + 1*sizeof(float[4]) + 3*sizeof(float), sizeof rs);
+		if (rs > 0.0f) {
+			break;
+		}
+	}
+	if (scene == n_frames) {
+		return;
+	}
+	glUseProgram(shader);
+	glUniform1i(4 /* lut_pass */, GL_TRUE);
+	glUniform1ui(5 /* lut_scene */, scene);
+	glBindImageTexture(1, lut, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RG32F);
+	glDispatchCompute(lut_width / compute_local_dim, lut_height / compute_local_dim, 2);
+	glUniform1i(4 /* lut_pass */, GL_FALSE);
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
 }
 
 char *map_persistent_buffer(GLenum target, GLenum access, size_t size)
 {
 	glBufferStorage(target, size, nullptr, GL_MAP_PERSISTENT_BIT | access);
-	return (char*) glMapBufferRange(target, 0, size, GL_MAP_PERSISTENT_BIT | GL_MAP_UNSYNCHRONIZED_BIT | access);
+	// unsynchronized reads are not allowed, those wait on fences instead
+	const GLbitfield sync = (access & GL_MAP_READ_BIT)? 0: GL_MAP_UNSYNCHRONIZED_BIT;
+	return (char*) glMapBufferRange(target, 0, size, GL_MAP_PERSISTENT_BIT | sync | access);
 }
 
-bool global_pause = false;
+// what was asked of -i since the last frame it drew
+struct playback_input
+{
+	bool paused;
+	// from a left press inside the window until its release,
+	// the clip follows the cursor once it moves from scrub_x
+	bool scrubbing;
+	double scrub_x;
+	// frames and fractions of the clip to move by, and where
+	// to move to as a fraction of the clip, negative if not
+	double seek_by;
+	double seek_by_clip;
+	double seek_to;
+	// what the speed is multiplied by, negative reverses it
+	double speed_scale;
+};
+static playback_input controls{false, false, 0.0, 0.0, 0.0, -1.0, 1.0};
 
 void key_callback(GLFWwindow *, int key, int, int action, int)
 {
-	if (key == GLFW_KEY_SPACE && action == GLFW_PRESS) {
-		global_pause ^= true;
+	if (action == GLFW_RELEASE) {
+		return;
+	}
+	const bool press = action == GLFW_PRESS;
+	if (key == GLFW_KEY_SPACE && press) {
+		controls.paused ^= true;
+	} else if (key == GLFW_KEY_LEFT || key == GLFW_KEY_RIGHT) {
+		controls.seek_by += key == GLFW_KEY_LEFT ? -double(chunk_frame_count) : chunk_frame_count;
+	} else if (key == GLFW_KEY_PAGE_UP || key == GLFW_KEY_PAGE_DOWN) {
+		controls.seek_by_clip += key == GLFW_KEY_PAGE_UP ? -0.1 : 0.1;
+	} else if (key == GLFW_KEY_COMMA || key == GLFW_KEY_PERIOD) {
+		// steps a frame at a time
+		controls.paused = true;
+		controls.seek_by += key == GLFW_KEY_COMMA ? -1.0 : 1.0;
+	} else if ((key == GLFW_KEY_UP || key == GLFW_KEY_DOWN) && press) {
+		controls.speed_scale *= key == GLFW_KEY_UP ? 2.0 : 0.5;
+	} else if (key == GLFW_KEY_R && press) {
+		controls.speed_scale = -controls.speed_scale;
+	} else if (key == GLFW_KEY_HOME || key == GLFW_KEY_END) {
+		controls.seek_to = key == GLFW_KEY_HOME ? 0.0 : 1.0;
+	} else if (key >= GLFW_KEY_0 && key <= GLFW_KEY_9 && press) {
+		controls.seek_to = (key - GLFW_KEY_0) / 10.0;
 	}
 }
 
-void handle_input(window *win)
+void mouse_button_callback(GLFWwindow *handle, int button, int action, int)
 {
-	while (global_pause) {
-		_mm_pause();
-		glfwPollEvents();
+	if (button != GLFW_MOUSE_BUTTON_LEFT) {
+		return;
+	}
+	if (action == GLFW_RELEASE) {
+		controls.scrubbing = false;
+		return;
+	}
+	double x;
+	double y;
+	int width;
+	int height;
+	glfwGetCursorPos(handle, &x, &y);
+	glfwGetWindowSize(handle, &width, &height);
+	if (x >= 0.0 && x < width && y >= 0.0 && y < height) {
+		controls.scrubbing = true;
+		controls.scrub_x = x;
 	}
 }
 
+// applies what was asked to `play`, false if it goes on as it was
+bool handle_input(window *win, play_order &play)
+{
+	bool changed = controls.seek_by != 0.0 || controls.seek_by_clip != 0.0
+		|| controls.seek_to >= 0.0 || controls.speed_scale != 1.0;
+	const double last = play.n_frames - 1;
+	if (controls.seek_to >= 0.0) {
+		play.seek(controls.seek_to * last);
+	}
+	play.seek(play.frame + controls.seek_by + controls.seek_by_clip * last);
+	const double speed = std::clamp(std::abs(play.speed * controls.speed_scale), 1.0/16.0, 16.0);
+	play.speed = std::copysign(speed, play.speed * controls.speed_scale);
+	controls = playback_input{controls.paused, controls.scrubbing, controls.scrub_x, 0.0, 0.0, -1.0, 1.0};
+	// dragging across the window scrubs through the clip
+	if (controls.scrubbing) {
+		double x;
+		double y;
+		int width;
+		int height;
+		glfwGetCursorPos(win->handle, &x, &y);
+		glfwGetWindowSize(win->handle, &width, &height);
+		if (x != controls.scrub_x) {
+			controls.scrub_x = x;
+			const GLuint before = play.current();
+			play.seek(std::clamp(x / std::max(width, 1), 0.0, 1.0) * last);
+			changed |= play.current() != before;
+		}
+	}
+	return changed;
+}
+
 int main(int argc, char **argv)
 {
 	auto cmd = parse_command_line(argc, argv);
+	if (cmd.cpu_trace && !cpu_trace_supported()) {
+		std::fprintf(stderr, "-c needs a CPU with AVX2 and FMA\n");
+		return 1;
+	}
 	off_t recover_chunk = 0;
 	file_header_t sim_repr;
+	chunk_index chunks;
 	if (cmd.mode == INPUT || cmd.mode == RECOVER) {
 		std::ifstream input{cmd.sim_path};
 		if (!input.read(reinterpret_cast<char*>(&sim_repr), sizeof sim_repr)) {
 			return 1;
 		}
-		if (cmd.mode == RECOVER) {
+		chunks = make_chunk_index(sim_repr, is_packed(sim_repr));
+		const size_t n_chunks = sim_repr.frame_count / chunk_frame_count;
+		if (chunks.packed && !input.read(reinterpret_cast<char*>(chunks.end.get()), n_chunks * sizeof(std::uint64_t))) {
+			return 1;
+		}
+		if (cmd.mode == RECOVER && chunks.packed) {
+			// chunks are indexed once they are all on disk
+			while (size_t(recover_chunk) < n_chunks && chunks.end[recover_chunk]) {
+				++recover_chunk;
+			}
+			if (recover_chunk <= 0) {
+				cmd.mode = OUTPUT;
+			}
+		} else if (cmd.mode == RECOVER) {
 			input.seekg(0, std::ios_base::end);
 			const size_t size = input.tellg();
-			const auto chunk_size = sim_repr.width * sim_repr.height * chunk_frame_count * host_pixel_size;
+			const auto chunk_size = sim_repr.width * sim_repr.height * chunk_frame_count * host_pixel_size(sim_repr.pixel_format);
 			// off_t is signed
 			recover_chunk = (size - sizeof sim_repr) / chunk_size - 1;
 			if (recover_chunk <= 0) {
@@ -264,8 +1167,12 @@ int main(int argc, char **argv)
 			}
 		}
 	}
-	glfw_context glfw{};
-	window win(0, 0, glfw);
+	if (cmd.offscreen && cmd.mode == INPUT) {
+		std::fprintf(stderr, "-i needs a window\n");
+		return 1;
+	}
+	glfw_context glfw{!cmd.offscreen};
+	window win = cmd.offscreen ? window{glfw} : window{0, 0, glfw};
 	GLuint graphics_shdr;
 	GLuint compute_shdr;
 	GLuint script;
@@ -280,11 +1187,12 @@ int main(int argc, char **argv)
 	}
 
 	const auto quad_va = describe_va();
-	io_init();
+	io_init(io_queue_depth);
 
 	if (cmd.mode == OUTPUT || cmd.mode == RECOVER) {
-		gl_ssb scene_state{1, 9*sizeof(float[4])};
-		gl_ssb scene_settings{0, (2*4 + 2) * sizeof(float[4])};
+		// the script's initial scene, the frames follow once their number is known
+		gl_ssb scene_init{1, scene_state_size};
+		gl_ssb scene_settings{0, (2*4 + 3) * sizeof(float[4])};
 
 		struct {
 			GLint width;
@@ -293,15 +1201,41 @@ int main(int argc, char **argv)
 			GLuint ms_per_frame;
 			GLuint skybox_id;
 			float fov;
+			GLuint pixel_format;
+			GLuint coarse_step;
+			float refine_tolerance;
+			GLuint samples_per_pixel;
+			GLuint max_samples_per_pixel;
+			float sample_tolerance;
 		} window_settings;
 		float exponents[3];
 		glUseProgram(script);
-		glUniform1f(2 /* progress */, -1.0f);
+		glUniform1i(2 /* init_pass */, GL_TRUE);
 		glDispatchCompute(1, 1, 1);
 		glFinish();
 
 		scene_settings.read(&window_settings, 2*4 * sizeof(float[4]), sizeof window_settings);
-		scene_state.read(exponents, 7*sizeof(float[4]) + 2*sizeof(float), sizeof exponents);
+		scene_init.read(exponents, 7*sizeof(float[4]) + 2*sizeof(float), sizeof exponents);
+		GLuint accr_hide;
+		GLuint use_lut;
+		scene_init.read(&accr_hide, 8*sizeof(float[4]) + 1*sizeof(float), sizeof accr_hide);
+		scene_init.read(&use_lut, 9*sizeof(float[4]) + 1*sizeof(float), sizeof use_lut);
+		GLuint integrator;
+		scene_init.read(&integrator, 8*sizeof(float[4]) + 2*sizeof(float), sizeof integrator);
+		float reproject_tolerance;
+		scene_init.read(&reproject_tolerance, 9*sizeof(float[4]) + 3*sizeof(float), sizeof reproject_tolerance);
+		if (cmd.cpu_trace && (integrator != 0 /* INTEGRATOR_RK4 */ || (accr_hide && use_lut))) {
+			std::fprintf(stderr, "[cpu] tracing with RK4 and without the deflection table\n");
+		}
+		assert(window_settings.samples_per_pixel > 0);
+		const GLuint max_samples = std::max(window_settings.samples_per_pixel, window_settings.max_samples_per_pixel);
+		if (cmd.cpu_trace && max_samples > 1) {
+			std::fprintf(stderr, "[cpu] tracing one ray per pixel\n");
+		}
+		// the CPU tracer is exact, and fast enough without it
+		const bool reprojecting = reproject_tolerance > 0.0f && !cmd.cpu_trace;
+		assert(window_settings.coarse_step > 0);
+		const GLuint coarse_step = cmd.cpu_trace ? 1 : window_settings.coarse_step;
 		assert(window_settings.width > 0 && window_settings.height > 0);
 		win.resize(window_settings.width, window_settings.height);
 		assert(window_settings.skybox_id < std::size(skybox_fmt));
@@ -314,77 +1248,274 @@ int main(int argc, char **argv)
 		sim_repr.bexp = exponents[2];
 		const GLuint skybox = load_skybox(GL_TEXTURE2, skybox_fmt[tex_id]);
 		sim_repr.ms_per_frame = window_settings.ms_per_frame;
+		assert(window_settings.pixel_format < pixel_format_count);
+		// -r carries on in the format the file was started with
+		if (cmd.mode == OUTPUT) {
+			sim_repr.pixel_format = window_settings.pixel_format;
+		}
+		const std::uint8_t format = sim_repr.pixel_format;
+
+		// n_frames should always be a multiple of chunk_frame_count
+		const size_t n_chunks = n_frames / chunk_frame_count;
 
+		// the script is cheap, so the scene of every frame is filled in at once
+		gl_ssb scene_state{1, (1 + n_frames) * scene_state_size};
+		glCopyNamedBufferSubData(scene_init.name, scene_state.name, 0, 0, scene_state_size);
+		glUseProgram(script);
+		glUniform1i(2 /* init_pass */, GL_FALSE);
+		glDispatchCompute(n_frames, 1, 1);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 		if (cmd.mode == OUTPUT) {
 			blocking_open_trunc(cmd.sim_path);
+			std::memcpy(sim_repr.magic, sim_magic, sizeof sim_magic);
+			sim_repr.version = sim_version_packed;
+			chunks = make_chunk_index(sim_repr, true);
+			complete_io_request(issue_io_request(io_work_type::write, chunks.end.get(),
+				n_chunks * sizeof(std::uint64_t), sizeof sim_repr));
 		} else {
 			blocking_open_recover(cmd.sim_path);
 		}
 		issue_io_request(io_work_type::write, &sim_repr, sizeof sim_repr, 0);
 		const size_t chunk_pixels = width * height * chunk_frame_count;
-		const size_t chunk_size = chunk_pixels * host_pixel_size;
-		off_t write_addr = sizeof sim_repr + recover_chunk * chunk_size;
+		const size_t chunk_size = chunk_pixels * host_pixel_size(format);
+		off_t write_addr = chunks.start(recover_chunk);
 
-		GLuint sim;
-		sim = texture_array(GL_TEXTURE0, GL_RGBA16_SNORM, width, height, chunk_frame_count);
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		const sim_chunk sim = chunk_textures(format, width, height);
+		GLuint lut = 0;
+		if (accr_hide && use_lut && !cmd.cpu_trace) {
+			lut = texture_array(GL_TEXTURE3, GL_RG32F, lut_width, lut_height, 2);
+			build_lut(compute_shdr, lut, scene_state, n_frames);
+		}
 
 		glProgramUniform1i(graphics_shdr, 4 /* skybox */, 2 /* GL_TEXTURE2 */);
 		glProgramUniform3f(graphics_shdr, 5, sim_repr.rexp, sim_repr.gexp, sim_repr.bexp);
-		glProgramUniform1i(graphics_shdr, 0 /* screen0 */, 0);
-		glProgramUniform1i(graphics_shdr, 1 /* screen1 */, 1);
+		glProgramUniform1i(graphics_shdr, 6 /* oct48 */, format == pixel_oct48);
+		glProgramUniform1i(compute_shdr, 6 /* oct48 */, format == pixel_oct48);
+		glProgramUniform1f(compute_shdr, 11 /* refine_tolerance */, window_settings.refine_tolerance);
+		glProgramUniform1ui(compute_shdr, 12 /* samples */, window_settings.samples_per_pixel);
+		glProgramUniform1ui(compute_shdr, 13 /* max_samples */, max_samples);
+		glProgramUniform1f(compute_shdr, 14 /* sample_tolerance */, window_settings.sample_tolerance);
 
-		GLuint compute_width = (width + compute_local_dim - 1) / compute_local_dim;
-		GLuint compute_height = (height + compute_local_dim - 1) / compute_local_dim;
-		auto buf = std::make_unique<std::uint16_t[][4]>(chunk_pixels);
-		// n_frames should always be a multiple of chunk_frame_count
-		for (size_t i_frame = recover_chunk * chunk_frame_count; win && i_frame < n_frames; ++i_frame) {
-			// const GLuint buffer = (i_frame / chunk_frame_count) % 2;
-			const GLuint frame_index = i_frame % chunk_frame_count;
-			float progress = smoothstep(float(i_frame) / float(n_frames-1));
-
-			glUseProgram(script);
-			glUniform1f(2 /* progress */, progress);
-			glDispatchCompute(1, 1, 1);
-			glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-
-			auto time_ref = clk::now();
-			for (GLint px_base_x = 0; px_base_x < width && win; px_base_x += compute_width * compute_local_dim) {
-				for (GLint px_base_y = 0; px_base_y < width && win; px_base_y += compute_height * compute_local_dim) {
-					glUseProgram(compute_shdr);
-					glUniform2i(3 /* px_base */, px_base_x, px_base_y);
-					enable_sim_frame(0, sim, frame_index, GL_RGBA16_SNORM);
-					glDispatchCompute(compute_width, compute_height, 1);
-					glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
-
-					draw_quad(graphics_shdr, quad_va, float(frame_index), float(0.0f));
-					win.present();
-					std::printf("\rframe %zu/%zu:%02zu%%",
-						i_frame+1, n_frames, (100 * (px_base_x * height + px_base_y)) / (width * height));
-					std::fflush(stdout);
-					const auto time_test = clk::now();
-					const auto elapsed = time_test - time_ref;
-					if (elapsed > 1s && compute_width > 16 && compute_height > 16) {
-						compute_width /= 2;
-						compute_height /= 2;
+		tile_sizer tiles{
+			GLuint((width + compute_local_dim - 1) / compute_local_dim),
+			GLuint((height + compute_local_dim - 1) / compute_local_dim),
+		};
+		// chunk i is packed into half i%2 while
+		// the previous one is written from the other
+		GLuint pixel_transfer;
+		glGenBuffers(1, &pixel_transfer);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pixel_transfer);
+		char *readback_memory =
+			map_persistent_buffer(GL_PIXEL_PACK_BUFFER, GL_MAP_READ_BIT | GL_MAP_COHERENT_BIT, 2 * chunk_size);
+		GLsync pack_fence[2] = { nullptr, nullptr };
+		io_token dump[2] = { io_no_token, io_no_token };
+		size_t dump_chunk[2];
+		std::unique_ptr<std::uint8_t[]> encoded[2];
+		const codec_layout layout = chunk_layout(format, chunk_pixels);
+		// packed chunks are encoded while the next one is traced
+		std::unique_ptr<chunk_encoder> encoder;
+		size_t encoding_buffer = 0;
+		size_t encoding_chunk = 0;
+		bool encoding = false;
+		if (chunks.packed) {
+			encoded[0] = std::make_unique<std::uint8_t[]>(chunk_encode_bound(layout, width * height, chunk_frame_count));
+			encoded[1] = std::make_unique<std::uint8_t[]>(chunk_encode_bound(layout, width * height, chunk_frame_count));
+			encoder = std::make_unique<chunk_encoder>();
+		}
+		io_token index_write = io_no_token;
+		static_assert(sizeof(cpu_scene) == scene_state_size);
+		std::unique_ptr<cpu_scene[]> cpu_scenes;
+		std::unique_ptr<float[]> cpu_pixels;
+		std::unique_ptr<float[]> cpu_scratch;
+		std::unique_ptr<cpu_tracer> tracer;
+		if (cmd.cpu_trace) {
+			tracer = std::make_unique<cpu_tracer>(std::thread::hardware_concurrency());
+			cpu_scenes = std::make_unique<cpu_scene[]>(chunk_frame_count);
+			cpu_pixels = std::make_unique<float[]>(4 * chunk_pixels);
+			cpu_scratch = std::make_unique<float[]>(2 * chunk_pixels);
+		}
+		auto issue_write = [&](size_t buffer, size_t i_chunk, void *data, size_t size) {
+			dump[buffer] = issue_dump(size, write_addr, data);
+			dump_chunk[buffer] = i_chunk;
+			write_addr += size;
+			if (chunks.packed) {
+				chunks.end[i_chunk] = write_addr;
+			}
+		};
+		// waits for the write from `buffer`, so that it can be reused
+		auto complete_write = [&](size_t buffer) {
+			if (dump[buffer] == io_no_token) {
+				return;
+			}
+			complete_io_request(dump[buffer]);
+			dump[buffer] = io_no_token;
+			if (chunks.packed) {
+				// only now can -r pick up after this chunk
+				if (index_write != io_no_token) {
+					complete_io_request(index_write);
+				}
+				const size_t i = dump_chunk[buffer];
+				index_write = issue_io_request(io_work_type::write, &chunks.end[i],
+					sizeof chunks.end[i], sizeof sim_repr + i * sizeof chunks.end[i]);
+			}
+		};
+		auto finish_encode = [&] {
+			if (encoding) {
+				const size_t size = encoder->finish();
+				issue_write(encoding_buffer, encoding_chunk, encoded[encoding_buffer].get(), size);
+				encoding = false;
+			}
+		};
+		auto write_out = [&](size_t buffer, size_t i_chunk) {
+			// the pack was issued a whole chunk earlier, so this rarely waits
+			fence_block(pack_fence[buffer]);
+			char *data = readback_memory + buffer * chunk_size;
+			if (!chunks.packed) {
+				issue_write(buffer, i_chunk, data, chunk_size);
+				return;
+			}
+			// the encoder writes where the chunk before this one was written from
+			complete_write(buffer);
+			encoder->start(chunk_encoder::job{
+				(const std::uint16_t*) data, layout, size_t(width * height), chunk_frame_count,
+				encoded[buffer].get(),
+			});
+			encoding = true;
+			encoding_buffer = buffer;
+			encoding_chunk = i_chunk;
+		};
+		// the preview is drawn at its own pace, so that with vsync the
+		// dispatches are not each held back by a refresh interval
+		const bool previewing = !win.offscreen() && cmd.preview_hz > 0.0f;
+		const auto preview_period = std::chrono::duration_cast<time_interval>(
+			std::chrono::duration<float>(previewing ? 1.0f / cmd.preview_hz : 0.0f));
+		instant_t next_preview = clk::now();
+		auto preview = [&] {
+			const auto now = clk::now();
+			if (!previewing || now < next_preview) {
+				win.poll_events();
+				return;
+			}
+			draw_quad(graphics_shdr, quad_va, float(chunk_frame_count-1));
+			win.present();
+			next_preview = now + preview_period;
+		};
+		size_t n_packed = 0;
+		for (size_t i_chunk = recover_chunk; win && i_chunk < n_chunks; ++i_chunk) {
+			const GLuint chunk_start = i_chunk * chunk_frame_count;
+			if (cmd.cpu_trace) {
+				std::printf("\rchunk %zu/%zu", i_chunk+1, n_chunks);
+				std::fflush(stdout);
+				glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+				scene_state.read(cpu_scenes.get(), (1 + chunk_start) * scene_state_size,
+					chunk_frame_count * scene_state_size);
+				tracer->trace_chunk(cpu_scenes.get(), chunk_frame_count, width, height,
+					format == pixel_oct48, cpu_pixels.get());
+				upload_chunk(format, sim, width, height, cpu_pixels.get(), cpu_scratch.get());
+				preview();
+			} else {
+				// with reprojection the first frame is traced on its
+				// own, the others then reuse what they can of it
+				const struct {
+					GLuint offset;
+					GLuint depth;
+					bool reproject;
+				} passes[2] = {
+					{ 0, reprojecting ? 1 : GLuint(chunk_frame_count), false },
+					{ 1, chunk_frame_count - 1, true },
+				};
+				glProgramUniform1ui(compute_shdr, 15 /* chunk_start */, chunk_start);
+				for (size_t i_pass = 0; i_pass < (reprojecting ? 2 : 1); ++i_pass) {
+					const auto &pass = passes[i_pass];
+					glProgramUniform1ui(compute_shdr, 7 /* frame_offset */, pass.offset);
+					glProgramUniform1i(compute_shdr, 8 /* reproject */, pass.reproject);
+					// the coarse grid first if there is one, then every pixel
+					for (const bool grid: { true, false }) {
+						if (grid && coarse_step == 1) {
+							continue;
+						}
+						const GLuint grid_step = grid ? coarse_step : 1;
+						const GLuint span = grid_step * compute_local_dim;
+						glProgramUniform1ui(compute_shdr, 9 /* grid_step */, grid_step);
+						glProgramUniform1ui(compute_shdr, 10 /* refine_step */, grid ? 0 : coarse_step);
+						const size_t kind = tile_sizer::kind(grid, pass.reproject);
+						// a row of tiles shares their height, their widths can vary
+						for (GLint px_base_y = 0; px_base_y < height && win;) {
+							const GLuint row_height = std::min<GLuint>(tiles.height(kind, pass.depth),
+								(height - px_base_y + span - 1) / span);
+							for (GLint px_base_x = 0; px_base_x < width && win;) {
+								const GLuint tile_width = std::min<GLuint>(tiles.width(kind, pass.depth, row_height),
+									(width - px_base_x + span - 1) / span);
+								glUseProgram(compute_shdr);
+								glUniform2i(3 /* px_base */, px_base_x, px_base_y);
+								enable_sim_chunk(format, sim);
+								tiles.begin(kind, tile_width, row_height, pass.depth);
+								glDispatchCompute(tile_width, row_height, pass.depth);
+								tiles.end();
+								glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+								px_base_x += tile_width * span;
+
+								preview();
+								if (grid) {
+									continue;
+								}
+								const size_t row_pixels = std::min<size_t>(row_height * span, height - px_base_y);
+								const size_t traced = pass.offset * width * height + pass.depth
+									* (px_base_y * width + std::min<size_t>(px_base_x, width) * row_pixels);
+								std::printf("\rchunk %zu/%zu:%02zu%%", i_chunk+1, n_chunks,
+									100 * traced / (width * height * chunk_frame_count));
+								std::fflush(stdout);
+							}
+							px_base_y += row_height * span;
+						}
+						glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
 					}
-					time_ref = time_test;
 				}
 			}
+			// closing the window cuts the chunk short, it is neither
+			// written nor indexed so that -r traces it again
+			if (!win) {
+				break;
+			}
 
-			if (frame_index == chunk_frame_count-1) {
-				// technically this only needs to wait for the request
-				// that was made for the previous issue with the same
-				// `buffer` index
-				complete_dump();
-				issue_dump(chunk_size, sim, write_addr, buf.get());
-				write_addr += chunk_size;
+			// the previous chunk was downloaded while this one was
+			// traced and the one before it encoded from the half that
+			// this chunk is about to be packed in, unpacked files are
+			// written straight from that half so it must be written out
+			const size_t buffer = n_packed % 2;
+			finish_encode();
+			if (n_packed) {
+				write_out(buffer ^ 1, i_chunk - 1);
 			}
+			if (!chunks.packed) {
+				complete_write(buffer);
+			}
+			issue_pack(format, sim, width, height, buffer * chunk_size, &pack_fence[buffer]);
+			++n_packed;
 		}
 		std::printf("\r                 \r");
-		// push the last issue
-		complete_dump();
+		// push the last issues
+		finish_encode();
+		if (n_packed) {
+			write_out((n_packed - 1) % 2, recover_chunk + n_packed - 1);
+			finish_encode();
+		}
+		complete_all_io_requests();
+		if (chunks.packed) {
+			complete_io_request(issue_io_request(io_work_type::write, chunks.end.get(),
+				n_chunks * sizeof(std::uint64_t), sizeof sim_repr));
+		}
 		blocking_close();
-		glDeleteTextures(1, &sim);
+		glDeleteSync(pack_fence[0]);
+		glDeleteSync(pack_fence[1]);
+		glDeleteBuffers(1, &pixel_transfer);
+		glDeleteTextures(max_planes, sim.plane);
+		glDeleteTextures(1, &lut);
+	}
+	// there is nothing to play the render back on
+	if (win.offscreen()) {
+		return 0;
 	}
 
 	assert(sim_repr.frame_count % chunk_frame_count == 0);
@@ -393,86 +1524,106 @@ int main(int argc, char **argv)
 	const auto width = sim_repr.width;
 	const auto height = sim_repr.height;
 	const auto n_frames = sim_repr.frame_count;
-	GLuint sim[2];
-	sim[0] = texture_array(GL_TEXTURE0, GL_RGBA16_SNORM, width, height, chunk_frame_count);
-	sim[1] = texture_array(GL_TEXTURE1, GL_RGBA16_SNORM, width, height, chunk_frame_count);
-
+	const std::uint8_t format = sim_repr.pixel_format;
+	assert(format < pixel_format_count);
 	if (win) {
 		win.resize(width, height);
-		blocking_open_read(cmd.sim_path);
+		blocking_open_read(cmd.sim_path, cmd.direct_io);
 		const size_t chunk_pixels = width * height * chunk_frame_count;
-		const size_t chunk_size = chunk_pixels * host_pixel_size;
+		const size_t chunk_size = chunk_pixels * host_pixel_size(format);
 		const off_t chunk_count = n_frames / chunk_frame_count;
 
 		assert(sim_repr.tex_id < std::size(skybox_fmt));
 		const GLuint skybox = load_skybox(GL_TEXTURE2, skybox_fmt[sim_repr.tex_id]);
 		glProgramUniform1i(graphics_shdr, 4 /* skybox */, 2 /* GL_TEXTURE2 */);
 		glProgramUniform3f(graphics_shdr, 5, sim_repr.rexp, sim_repr.gexp, sim_repr.bexp);
+		glProgramUniform1i(graphics_shdr, 6 /* oct48 */, format == pixel_oct48);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 
+		const size_t depth = cmd.playback_depth;
+		// direct reads land at the file offset modulo the block
+		// size past the start of a slot, so leave room for that
+		const size_t io_alignment = io_read_alignment();
+		const size_t slot_stride = (chunk_size + 2*io_alignment - 2) / io_alignment * io_alignment;
+		const size_t streaming_size = depth * slot_stride + io_alignment - 1;
 		GLuint pixel_transfer;
 		glGenBuffers(1, &pixel_transfer);
 		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixel_transfer);
 		// TODO: fix screen tearing
 		char *streaming_memory =
-			map_persistent_buffer(GL_PIXEL_UNPACK_BUFFER, GL_MAP_WRITE_BIT, 2 * chunk_size);
-
-		off_t video_file_offset = sizeof sim_repr;
-		assert(n_frames >= 2*chunk_frame_count);
-		blocking_load(streaming_memory, 2*chunk_size, video_file_offset);
-		pixel_unpack(sim[0], width, height, 0);
-		pixel_unpack(sim[1], width, height, chunk_size);
-		fence_block(transfer_fence);
-		// rreq is made as if it produced the current state
-		const auto ichunksize = off_t(chunk_size);
-		blocking_load(streaming_memory, chunk_size, video_file_offset + (2%chunk_count)*ichunksize);
-		io_request rreq{streaming_memory, chunk_size, video_file_offset + (2%chunk_count)*ichunksize};
-
-		auto upload_state = try_stream_load_nop;
-		GLuint prev_chunk = 0;
-		size_t device_addr = chunk_size;
-		const auto start_time = clk::now();
-		const std::chrono::milliseconds frame_time{sim_repr.ms_per_frame};
-		glfwSetKeyCallback(win.handle, key_callback);
-		for (GLuint present_frame = 0; win; ++present_frame) {
-			handle_input(&win);
-			float a = (float) glfwGetTime();
-			const GLuint anim_frame = back_and_forth(present_frame, n_frames - 1);
-			const GLuint chunk = anim_frame / chunk_frame_count;
-			const GLuint buffer = chunk % 2;
-			const GLuint next_buffer = buffer ^ 1;
-			const GLuint buffer_index = anim_frame % chunk_frame_count;
-			const auto frame_start_time = start_time + (present_frame-1) * frame_time;
-			const auto deadline = frame_start_time + frame_time/2;
-			upload_state = try_stream_load(rreq, width, height, device_addr,
-				sim[next_buffer], upload_state, deadline);
-			if (chunk != prev_chunk) {
-				const GLuint loading_frame = back_and_forth(
-					present_frame + 3*chunk_frame_count-1,
-					n_frames - 1
-				);
-				const GLuint loading_chunk = loading_frame / chunk_frame_count;
-				upload_state = try_stream_load_reset;
-				device_addr = next_buffer * chunk_size;
-				rreq.buf = streaming_memory + buffer * chunk_size;
-				rreq.addr = video_file_offset + loading_chunk * chunk_size;
-				prev_chunk = chunk;
-			}
-
-			const auto present_time = start_time + present_frame * frame_time;
-			auto now = clk::now();
-			while (now < present_time - poll_period * 3) {
-				std::this_thread::sleep_for(poll_period);
-				now = clk::now();
-			}
-			while (now < present_time) {
-				_mm_pause();
-				now = clk::now();
-			}
-			draw_quad(graphics_shdr, quad_va, float(buffer_index), float(buffer));
-			win.present();
+			map_persistent_buffer(GL_PIXEL_UNPACK_BUFFER, GL_MAP_WRITE_BIT, streaming_size);
+		const size_t streaming_base = -(std::uintptr_t) streaming_memory % io_alignment;
+		// packed chunks are read to the side and decoded into the slots
+		std::unique_ptr<chunk_decoder> decoder;
+		std::unique_ptr<char[]> packed_memory;
+		char *packed_slots = nullptr;
+		size_t packed_stride = 0;
+		if (chunks.packed) {
+			size_t packed_max = 0;
+			for (off_t i = 0; i < chunk_count; ++i) {
+				packed_max = std::max(packed_max, chunks.size(i));
+			}
+			packed_stride = (packed_max + 2*io_alignment - 2) / io_alignment * io_alignment;
+			const size_t packed_size = depth * packed_stride + io_alignment - 1;
+			packed_memory = std::make_unique<char[]>(packed_size);
+			packed_slots = packed_memory.get() + -(std::uintptr_t) packed_memory.get() % io_alignment;
+			io_register_buffer(packed_memory.get(), packed_size);
+			decoder = std::make_unique<chunk_decoder>();
+		} else {
+			io_register_buffer(streaming_memory, streaming_size);
+		}
+
+		{
+			playback_cache cache{format, GLuint(width), GLuint(height), chunks, depth,
+				streaming_memory, streaming_base, slot_stride,
+				packed_slots, packed_stride, decoder.get()};
+			play_order play{GLuint(n_frames), cmd.loop, 0.0, 1.0};
+			auto plan = [&] {
+				GLuint needed[max_playback_depth];
+				cache.plan(needed, play.upcoming(needed, depth));
+			};
+			plan();
+			cache.settle();
+			cache.show(play.chunk());
+
+			const auto start_time = clk::now();
+			const std::chrono::milliseconds frame_time{sim_repr.ms_per_frame};
+			glfwSetKeyCallback(win.handle, key_callback);
+			glfwSetMouseButtonCallback(win.handle, mouse_button_callback);
+			for (GLuint present_frame = 0; win; ++present_frame) {
+				const bool moved = handle_input(&win, play);
+				float a = (float) glfwGetTime();
+				const GLuint anim_frame = play.current();
+				const GLuint chunk = anim_frame / chunk_frame_count;
+				const GLuint buffer_index = anim_frame % chunk_frame_count;
+				if (moved || chunk != cache.current().chunk) {
+					plan();
+					cache.show(chunk);
+				}
+				const auto frame_start_time = start_time + (present_frame-1) * frame_time;
+				const auto deadline = frame_start_time + frame_time/2;
+				cache.stream(deadline);
+
+				const auto present_time = start_time + present_frame * frame_time;
+				auto now = clk::now();
+				while (now < present_time - poll_period * 3) {
+					std::this_thread::sleep_for(poll_period);
+					now = clk::now();
+				}
+				while (now < present_time) {
+					_mm_pause();
+					now = clk::now();
+				}
+				bind_sim_chunk(format, cache.current().sim);
+				draw_quad(graphics_shdr, quad_va, float(buffer_index));
+				win.present();
+				if (!controls.paused && !controls.scrubbing) {
+					play.tick();
+				}
+			}
 		}
 		blocking_close();
-		glDeleteTextures(2, sim);
+		io_unregister_buffer();
 		glDeleteBuffers(1, &pixel_transfer);
 	}
 
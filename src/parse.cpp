@@ -2,41 +2,82 @@
 #include "shader.hpp"
 
 
+[[noreturn]] static void usage(const char *argv0)
+{
+	std::printf("usage:\n");
+	std::printf("%s <script>.glsl [-r <partial-file>] [-o <output-file>] [-c] [-s] [-p <hz>]\n", argv0);
+	std::printf("%s -i <input-file> [-d] [-b <chunks>] [-l]\n", argv0);
+	std::exit(1);
+}
+
 command_line parse_command_line(int argc, char **argv)
 {
 	static constexpr const char *const default_sim_path = "/tmp/black_hole_sim_data.rgbf32";
 	command_line cl;
-	if (argc == 3 && std::strcmp(argv[1], "-i") == 0) {
+	cl.direct_io = false;
+	cl.cpu_trace = false;
+	cl.offscreen = false;
+	cl.preview_hz = 10.0f;
+	cl.playback_depth = 3;
+	cl.loop = false;
+	if (argc >= 3 && std::strcmp(argv[1], "-i") == 0) {
 		cl.mode = INPUT;
 		cl.sim_path = argv[2];
-	} else if (argc == 2) {
-		cl.mode = OUTPUT;
-		cl.sim_path = default_sim_path;
-		cl.script_path = argv[1];
-	} else if (argc == 4) {
-		cl.script_path = argv[1];
-		cl.sim_path = argv[3];
-		if (std::strcmp(argv[2], "-r") == 0) {
-			cl.mode = RECOVER;
-		} else if (std::strcmp(argv[2], "-o") == 0) {
-			cl.mode = OUTPUT;
-		} else {
-			goto usage;
+		for (int i = 3; i < argc; ++i) {
+			const bool has_value = i + 1 < argc;
+			if (std::strcmp(argv[i], "-d") == 0) {
+				cl.direct_io = true;
+			} else if (std::strcmp(argv[i], "-b") == 0 && has_value) {
+				// one chunk is drawn while the others load
+				char *end;
+				const unsigned long depth = std::strtoul(argv[++i], &end, 10);
+				if (*end || depth < 2 || depth > max_playback_depth) {
+					usage(argv[0]);
+				}
+				cl.playback_depth = depth;
+			} else if (std::strcmp(argv[i], "-l") == 0) {
+				cl.loop = true;
+			} else {
+				usage(argv[0]);
+			}
 		}
-	} else if (argc == 6) {
-		if (std::strcmp(argv[2], "-r") != 0 || std::strcmp(argv[4], "-o") != 0) {
-			goto usage;
+		return cl;
+	}
+	if (argc < 2 || argv[1][0] == '-') {
+		usage(argv[0]);
+	}
+	cl.mode = OUTPUT;
+	cl.script_path = argv[1];
+	const char *partial_path = nullptr;
+	const char *output_path = nullptr;
+	// the options can come in any order
+	for (int i = 2; i < argc; ++i) {
+		const bool has_value = i + 1 < argc;
+		if (std::strcmp(argv[i], "-r") == 0 && has_value) {
+			partial_path = argv[++i];
+		} else if (std::strcmp(argv[i], "-o") == 0 && has_value) {
+			output_path = argv[++i];
+		} else if (std::strcmp(argv[i], "-c") == 0) {
+			// traces with the CPU instead of compute.glsl
+			cl.cpu_trace = true;
+		} else if (std::strcmp(argv[i], "-s") == 0) {
+			// renders without a window or a display
+			cl.offscreen = true;
+		} else if (std::strcmp(argv[i], "-p") == 0 && has_value) {
+			// how often the render is previewed, 0 never
+			char *end;
+			cl.preview_hz = std::strtof(argv[++i], &end);
+			if (*end || !(cl.preview_hz >= 0.0f)) {
+				usage(argv[0]);
+			}
+		} else {
+			usage(argv[0]);
 		}
+	}
+	if (partial_path) {
 		cl.mode = RECOVER;
-		cl.sim_path = argv[5];
-		cl.script_path = argv[1];
-	} else {
-	usage:
-		std::printf("usage:\n");
-		std::printf("%s <script>.glsl [-r <partial-file>] [-o <output-file>]\n", argv[0]);
-		std::printf("%s -i <input-file>\n", argv[0]);
-		std::exit(1);
 	}
+	cl.sim_path = output_path ? output_path : partial_path ? partial_path : default_sim_path;
 	return cl;
 }
 
@@ -21,9 +21,25 @@ struct window_settings {
 
 	uint skybox_id;
 	float fov;
+	uint pixel_format;
+	// traces every coarse_step pixels and fills in those between
+	// where they differ by less than refine_tolerance, 1 traces all
+	uint coarse_step;
+
+	float refine_tolerance;
+	// rays averaged per pixel, square numbers stratify best, then
+	// more rounds of as many up to max_samples_per_pixel for pixels
+	// where they vary by more than sample_tolerance
+	uint samples_per_pixel;
+	uint max_samples_per_pixel;
+	float sample_tolerance;
 };
 
-uniform layout(location=2) float progress;
+// init() runs once on its own, then loop() runs for every
+// frame of the render at once, one per work group
+uniform layout(location=2) bool init_pass;
+float progress;
+uint frame;
 
 layout(std430,binding=0) restrict buffer scene_settings_buf
 {
@@ -32,11 +48,16 @@ layout(std430,binding=0) restrict buffer scene_settings_buf
 	window_settings win;
 };
 
-layout(std430,binding=1) writeonly restrict buffer scene_spec
+// init() fills scene_init, which every frame
+// starts from before loop() updates it
+layout(std430,binding=1) restrict buffer scene_spec
 {
-	scene_state scene;
+	scene_state scene_init;
+	scene_state scenes[];
 };
 
+scene_state scene;
+
 layout(local_size_x = 1, local_size_y = 1, local_size_z = 1) in;
 
 const vec3 X = vec3(1.0, 0.0, 0.0);
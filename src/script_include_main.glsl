@@ -2,13 +2,34 @@
 
 void main()
 {
-	if (progress == -1.0) {
+	if (init_pass) {
 		scene.accr_hide = false;
+		scene.integrator = INTEGRATOR_RK4;
+		// relative to the radius and to the speed of light, floats
+		// don't resolve much under 1e-6 of either
+		scene.tolerance = 1e-5;
+		scene.escape_r = 0.0;
+		scene.use_lut = false;
+		scene.dphi = 0.01;
+		scene.reproject_tolerance = 0.0;
+		win.pixel_format = PIXEL_RGBA16;
+		win.coarse_step = 1;
+		win.refine_tolerance = 1e-3;
+		win.samples_per_pixel = 1;
+		win.max_samples_per_pixel = 0;
+		win.sample_tolerance = 1e-2;
 		init();
+		scene_init = scene;
 	} else {
+		frame = gl_GlobalInvocationID.x;
+		// flat tangents at 0 & 1, mapping [0,1] to [0,1]
+		float x = float(frame) / float(win.n_frames - 1);
+		progress = 3.0 * x * x - 2.0 * x * x * x;
+		scene = scene_init;
 		scene.inv_screen_width = 1.0 / float(win.screen_width);
 		scene.focal_length = 0.5 / tan(0.5 * win.fov);
 		loop();
+		scenes[frame] = scene;
 	}
 }
 
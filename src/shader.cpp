@@ -33,9 +33,148 @@ GLuint compile_shader(const char *src, GLenum kind)
 	return id;
 }
 
+// linked programs are kept in $XDG_CACHE_HOME/hole (~/.cache/hole by
+// default) as their binary format followed by what glGetProgramBinary()
+// returns, named after a hash of their sources and of the driver, one that
+// the driver rejects is rebuilt
+static constexpr size_t cache_path_size = 512;
+
+// the driver is handed whatever is in the cache, so only files and
+// directories of ours, that nobody else can write to, are trusted
+static bool trusted(const struct stat &st, mode_t kind)
+{
+	return (st.st_mode & S_IFMT) == kind && st.st_uid == getuid() && !(st.st_mode & (S_IWGRP|S_IWOTH));
+}
+
+// false if there is no directory to use, the programs are then not cached
+static bool cache_dir(char (&dir)[cache_path_size])
+{
+	const char *xdg = std::getenv("XDG_CACHE_HOME");
+	const char *home = std::getenv("HOME");
+	int n;
+	if (xdg && xdg[0] == '/') {
+		n = std::snprintf(dir, sizeof dir, "%s", xdg);
+	} else if (home && home[0] == '/') {
+		n = std::snprintf(dir, sizeof dir, "%s/.cache", home);
+	} else {
+		return false;
+	}
+	if (n < 0 || size_t(n) + sizeof "/hole" > sizeof dir) {
+		return false;
+	}
+	mkdir(dir, 0700);
+	std::strcat(dir, "/hole");
+	mkdir(dir, 0700);
+	struct stat st;
+	return stat(dir, &st) == 0 && trusted(st, S_IFDIR);
+}
+
+// FNV-1a, over the terminator too so that texts can't run into each other
+static std::uint64_t hash_text(std::uint64_t hash, const char *text)
+{
+	do {
+		hash ^= std::uint8_t(*text);
+		hash *= 0x100000001b3;
+	} while (*text++);
+	return hash;
+}
+
+static bool cache_path(char (&path)[cache_path_size], std::initializer_list<const char *> sources)
+{
+	char dir[cache_path_size];
+	if (!cache_dir(dir)) {
+		return false;
+	}
+	std::uint64_t hash = 0xcbf29ce484222325;
+	for (const GLenum name: { GL_VENDOR, GL_RENDERER, GL_VERSION }) {
+		hash = hash_text(hash, (const char *) glGetString(name));
+	}
+	for (const auto src: sources) {
+		hash = hash_text(hash, src);
+	}
+	const int n = std::snprintf(path, sizeof path, "%s/%016llx.bin", dir, (unsigned long long) hash);
+	return n > 0 && size_t(n) + sizeof ".XXXXXX" <= sizeof path;
+}
+
+static bool load_cached(GLuint id, const char *path)
+{
+	const int fd = open(path, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !trusted(st, S_IFREG) || st.st_size <= off_t(sizeof(GLenum))) {
+		close(fd);
+		return false;
+	}
+	FILE *file = fdopen(fd, "rb");
+	if (!file) {
+		close(fd);
+		return false;
+	}
+	const size_t size = st.st_size - sizeof(GLenum);
+	GLenum format;
+	auto binary = std::make_unique<char[]>(size);
+	const bool read = std::fread(&format, sizeof format, 1, file) == 1
+		&& std::fread(binary.get(), size, 1, file) == 1;
+	std::fclose(file);
+	if (!read) {
+		return false;
+	}
+	GLint n_formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &n_formats);
+	auto formats = std::make_unique<GLint[]>(n_formats);
+	glGetIntegerv(GL_PROGRAM_BINARY_FORMATS, formats.get());
+	if (std::find(formats.get(), formats.get() + n_formats, GLint(format)) == formats.get() + n_formats) {
+		return false;
+	}
+	glProgramBinary(id, format, binary.get(), size);
+	int success;
+	glGetProgramiv(id, GL_LINK_STATUS, &success);
+	return success;
+}
+
+static void store_cached(GLuint id, const char *path)
+{
+	GLint size = 0;
+	glGetProgramiv(id, GL_PROGRAM_BINARY_LENGTH, &size);
+	if (size <= 0) {
+		return;
+	}
+	GLenum format;
+	auto binary = std::make_unique<char[]>(size);
+	glGetProgramBinary(id, size, nullptr, &format, binary.get());
+	// written aside first, to a new file of a name nobody could have
+	// guessed, so that another run never loads half of it
+	char tmp_path[cache_path_size];
+	std::snprintf(tmp_path, sizeof tmp_path, "%s.XXXXXX", path);
+	const int fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		return;
+	}
+	FILE *file = fdopen(fd, "wb");
+	if (!file) {
+		close(fd);
+		unlink(tmp_path);
+		return;
+	}
+	bool written = std::fwrite(&format, sizeof format, 1, file) == 1
+		&& std::fwrite(binary.get(), size, 1, file) == 1;
+	written = std::fclose(file) == 0 && written;
+	if (!written || std::rename(tmp_path, path) != 0) {
+		unlink(tmp_path);
+	}
+}
+
 GLuint build_shader(const char *vert_src, const char *frag_src)
 {
 	const auto id = glCreateProgram();
+	char path[cache_path_size];
+	const bool cached = cache_path(path, { vert_src, frag_src });
+	if (cached && load_cached(id, path)) {
+		return id;
+	}
+	glProgramParameteri(id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	const auto vert = compile_shader(vert_src, GL_VERTEX_SHADER);
 	const auto frag = compile_shader(frag_src, GL_FRAGMENT_SHADER);
 	glAttachShader(id, vert);
@@ -46,18 +185,30 @@ GLuint build_shader(const char *vert_src, const char *frag_src)
 	glDetachShader(id, frag);
 	glDeleteShader(vert);
 	glDeleteShader(frag);
+	if (cached) {
+		store_cached(id, path);
+	}
 	return id;
 }
 
 GLuint build_shader(const char *comp_src)
 {
 	const auto id = glCreateProgram();
+	char path[cache_path_size];
+	const bool cached = cache_path(path, { comp_src });
+	if (cached && load_cached(id, path)) {
+		return id;
+	}
+	glProgramParameteri(id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	const auto comp = compile_shader(comp_src, GL_COMPUTE_SHADER);
 	glAttachShader(id, comp);
 	glLinkProgram(id);
 	link_test(id);
 	glDetachShader(id, comp);
 	glDeleteShader(comp);
+	if (cached) {
+		store_cached(id, path);
+	}
 	return id;
 }
 
@@ -30,6 +30,25 @@ struct scene_state {
 
 	float blue_exponent;
 	bool accr_hide;
+	uint integrator;
+	float tolerance;
+
+	float escape_r;
+	bool use_lut;
+	float dphi;
+	float reproject_tolerance;
 };
 
 #define PI 3.1415927
+
+// values of scene.integrator
+#define INTEGRATOR_RK4 0
+#define INTEGRATOR_RK45 1
+#define INTEGRATOR_BINET 2
+
+// values of win.pixel_format, the file stores either
+// RGBA16_SNORM (ray.xy, transmittance with the sign of ray.z, light)
+// or an R32UI plane of the octahedral ray in 2x12 bits and transmittance
+// in 8 and an R16 plane of light, a quarter smaller
+#define PIXEL_RGBA16 0
+#define PIXEL_OCT48 1
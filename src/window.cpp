@@ -1,15 +1,23 @@
 #include "window.hpp"
+#define EGL_NO_X11
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 
 
-glfw_context::glfw_context()
+glfw_context::glfw_context(bool init)
+	: initialized{init}
 {
-	glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_X11);
-	glfwInit();
+	if (init) {
+		glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_X11);
+		glfwInit();
+	}
 }
 
 glfw_context::~glfw_context()
 {
-	glfwTerminate();
+	if (initialized) {
+		glfwTerminate();
+	}
 }
 
 static void APIENTRY dbg_callback(
@@ -84,7 +92,17 @@ static void APIENTRY dbg_callback(
 		ssource, stype, sseverity, id, static_cast<int>(len), msg);
 }
 
+static void setup_context(int width, int height)
+{
+	glEnable(GL_DEBUG_OUTPUT);
+	glDebugMessageCallback(dbg_callback, nullptr);
+	glViewport(0, 0, width, height);
+	glEnable(GL_CULL_FACE);
+	glCullFace(GL_BACK);
+}
+
 window::window(int width, int height, glfw_context &)
+	: egl_display{EGL_NO_DISPLAY}, egl_context{EGL_NO_CONTEXT}
 {
 	if (width == 0 && height == 0) {
 		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
@@ -99,25 +117,67 @@ window::window(int width, int height, glfw_context &)
 	handle = glfwCreateWindow(width, height, title, nullptr, nullptr);
 	glfwMakeContextCurrent(handle);
 	gladLoadGL(glfwGetProcAddress);
-	glEnable(GL_DEBUG_OUTPUT);
-	glDebugMessageCallback(dbg_callback, nullptr);
-	glViewport(0, 0, width, height);
-	glEnable(GL_CULL_FACE);
-	glCullFace(GL_BACK);
+	setup_context(width, height);
+}
+
+window::window(glfw_context &)
+	: handle{nullptr}
+{
+	auto get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (!get_platform_display) {
+		std::fprintf(stderr, "[EGL] no EGL_EXT_platform_base\n");
+		std::exit(1);
+	}
+	EGLDisplay display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+	if (display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr)) {
+		std::fprintf(stderr, "[EGL] no surfaceless display\n");
+		std::exit(1);
+	}
+	eglBindAPI(EGL_OPENGL_API);
+	const EGLint attributes[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 4,
+		EGL_CONTEXT_MINOR_VERSION, 5,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_NONE,
+	};
+	// EGL_KHR_no_config_context, there is no surface to match
+	EGLContext context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, attributes);
+	if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+		std::fprintf(stderr, "[EGL] can't make a GL 4.5 core context current\n");
+		std::exit(1);
+	}
+	egl_display = display;
+	egl_context = context;
+	gladLoadGL((GLADloadfunc) eglGetProcAddress);
+	setup_context(0, 0);
 }
 
 window::~window()
 {
-	glfwDestroyWindow(handle);
+	if (offscreen()) {
+		eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		eglDestroyContext(egl_display, egl_context);
+		eglTerminate(egl_display);
+	} else {
+		glfwDestroyWindow(handle);
+	}
+}
+
+bool window::offscreen() const
+{
+	return handle == nullptr;
 }
 
 window::operator bool() const
 {
-	return !glfwWindowShouldClose(handle);
+	return offscreen() || !glfwWindowShouldClose(handle);
 }
 
 void window::resize(int width, int height)
 {
+	if (offscreen()) {
+		return;
+	}
 	glfwShowWindow(handle);
 	glfwSetWindowSize(handle, width, height);
 	glViewport(0, 0, width, height);
@@ -125,8 +185,17 @@ void window::resize(int width, int height)
 
 void window::present()
 {
+	if (offscreen()) {
+		return;
+	}
 	glfwSwapBuffers(handle);
 	glfwPollEvents();
 	glClear(GL_COLOR_BUFFER_BIT);
 }
 
+void window::poll_events()
+{
+	if (!offscreen()) {
+		glfwPollEvents();
+	}
+}